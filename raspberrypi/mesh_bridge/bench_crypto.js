@@ -0,0 +1,50 @@
+// Microbenchmark of the crypto backends on the per-packet operations of the decoder:
+// PECB for deobfuscation, network layer and access layer decryption.
+// Usage: node bench_crypto.js [iterations]
+
+const iterations = parseInt(process.argv[2]) || 100000;
+
+// sample keys and nonces, the values don't matter for timing
+const key = Buffer.from("7dd7364cd842ad18c17c2b820c84c3d6", 'hex');
+const network_nonce = Buffer.from("00800000011201000012345678", 'hex');
+const app_nonce = Buffer.from("01000000011201ffff12345678", 'hex');
+const pecb_input = Buffer.from("000000000012345678b5e5bfdacbaf6c", 'hex');
+// unsegmented gas status: DST (2) + lower transport header (1) + access payload (5) + TransMIC (4)
+const network_plaintext = Buffer.from("ffff6652132a9001aabbccdd", 'hex');
+const access_plaintext = Buffer.from("52132a9001", 'hex');
+
+function time(name, fn) {
+  // warm up
+  for (let i = 0; i < 1000; i++) {
+    fn();
+  }
+  let start = process.hrtime.bigint();
+  for (let i = 0; i < iterations; i++) {
+    fn();
+  }
+  let ns = Number(process.hrtime.bigint() - start) / iterations;
+  console.log(`  ${name.padEnd(20)} ${ns.toFixed(0).padStart(8)} ns/op`);
+  return ns;
+}
+
+function bench(backend_file) {
+  let start = process.hrtime.bigint();
+  let backend = require(backend_file);
+  let load_ms = Number(process.hrtime.bigint() - start) / 1e6;
+
+  console.log(`${backend.name} (module load ${load_ms.toFixed(1)} ms)`);
+
+  let ctx = backend.createKey(key);
+  let enc_network = backend.ccmEncrypt(ctx, network_nonce, network_plaintext, 4);
+  let enc_access = backend.ccmEncrypt(ctx, app_nonce, access_plaintext, 4);
+
+  let total = 0;
+  total += time("pecb (ecb)", () => backend.ecb(ctx, pecb_input));
+  total += time("network decrypt", () => backend.ccmDecrypt(ctx, network_nonce, enc_network, 4));
+  total += time("access decrypt", () => backend.ccmDecrypt(ctx, app_nonce, enc_access, 4));
+  time("cmac", () => backend.cmac(ctx, pecb_input));
+  console.log(`  ${"per packet".padEnd(20)} ${total.toFixed(0).padStart(8)} ns`);
+}
+
+bench('./crypto_asmcrypto.js');
+bench('./crypto_native.js');
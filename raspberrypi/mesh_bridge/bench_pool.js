@@ -0,0 +1,126 @@
+// Throughput of the decoder on synthetic sensor traffic, inline and with 1 to 4 crypto
+// workers (see crypto_pool.js). The traffic comes from traffic_gen.js with the keys of
+// config.js: gas readings in unsegmented messages and, one sensor in four, THP readings
+// in two segments, from several sources interleaved. Every run must decode all the
+// messages, which checks that the pool keeps the per-source order.
+// Usage: node bench_pool.js [messages] [backend]
+
+const crypto = require('./crypto.js');
+const decoder = require('./decoder.js');
+const replay = require('./replay.js');
+const reassembly = require('./reassembly.js');
+const crypto_pool = require('./crypto_pool.js');
+const traffic_gen = require('./traffic_gen.js');
+
+const requested = parseInt(process.argv[2]) || 20000;
+const backend = process.argv[3] || "native";
+const SOURCES = 16;
+const MAX_WORKERS = 4;
+// sensors publish every second, a network PDU per notification
+const TRAFFIC_OPTIONS = { sources: SOURCES, thp_ratio: 0.25, thp_period: 1, gas_period: 1, mtu: 69 };
+
+// the bench prints only its results
+const log = console.log;
+console.log = () => {};
+const mesh_keys = traffic_gen.keys();
+crypto.init(backend);
+decoder.setKeys(mesh_keys.hex_netkeys, mesh_keys.hex_appkeys);
+decoder.setIvIndex(mesh_keys.hex_iv_index);
+console.log = log;
+
+// messages in the traffic, about requested of them
+let messages = 0;
+
+function generate() {
+  let options = traffic_gen.parseArgs([]);
+  Object.assign(options, TRAFFIC_OPTIONS, { duration: Math.ceil(requested / SOURCES) });
+  console.log = () => {};
+  let traffic = traffic_gen.generate(options);
+  crypto.init(backend);
+  console.log = log;
+  messages = traffic.stats.messages;
+  return traffic.records.map(record => record.data);
+}
+
+function reset() {
+  decoder.reset();
+  replay.clear();
+}
+
+function report(name, pdus, decoded, ns) {
+  let pps = pdus.length / (ns / 1e9);
+  log(`  ${name.padEnd(12)} ${pps.toFixed(0).padStart(8)} PDU/s ${(ns / 1e6).toFixed(0).padStart(7)} ms ` +
+    `${decoded}/${messages} messages` + (decoded != messages ? "  ERROR: messages lost" : ""));
+}
+
+function benchInline(pdus) {
+  reset();
+  let link = reassembly.createProxyReassembly();
+  let decoded = 0;
+  let start = process.hrtime.bigint();
+  for (let pdu of pdus) {
+    if (decoder.decodeProxyPdu(pdu, link).status == decoder.DECODE_OK) {
+      decoded++;
+    }
+  }
+  report("inline", pdus, decoded, Number(process.hrtime.bigint() - start));
+}
+
+// PDUs are fed as fast as the pool takes them, pausing while it is saturated
+function benchPool(pdus, workers) {
+  reset();
+  crypto_pool.init(workers, {
+    crypto_backend: backend,
+    keys: [mesh_keys.hex_netkeys, mesh_keys.hex_appkeys],
+    iv_index: mesh_keys.hex_iv_index
+  });
+  decoder.setPool(crypto_pool);
+
+  return new Promise(resolve => {
+    let link = reassembly.createProxyReassembly();
+    let next = 0;
+    let done = 0;
+    let decoded = 0;
+    let start;
+
+    let feed = () => {
+      while (next < pdus.length && !crypto_pool.isSaturated()) {
+        decoder.submitProxyPdu(pdus[next++], link, onResult);
+      }
+    };
+    let onResult = result => {
+      if (result.status == decoder.DECODE_OK) {
+        decoded++;
+      }
+      if (++done == pdus.length) {
+        report(`${workers} worker${workers > 1 ? "s" : ""}`, pdus, decoded, Number(process.hrtime.bigint() - start));
+        crypto_pool.setPressureHandler(null);
+        crypto_pool.close().then(resolve);
+      }
+    };
+    crypto_pool.setPressureHandler(saturated => {
+      if (!saturated) {
+        setImmediate(feed);
+      }
+    });
+
+    // let the workers load before timing
+    setTimeout(() => {
+      start = process.hrtime.bigint();
+      feed();
+    }, 500);
+  });
+}
+
+async function main() {
+  log(`Generating about ${requested} messages from ${SOURCES} sources...`);
+  let pdus = generate();
+  log(`${messages} messages in ${pdus.length} proxy PDUs, crypto backend ${backend}`);
+
+  benchInline(pdus);
+  for (let workers = 1; workers <= MAX_WORKERS; workers++) {
+    await benchPool(pdus, workers);
+  }
+}
+
+main();
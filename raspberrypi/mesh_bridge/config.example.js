@@ -8,6 +8,22 @@ exports.hex_netkey = "644B6AD060C9088ADE0F54EF68930F16";
 exports.hex_appkey = "915C42B6C4D10AE7CA224776D57D249F";
 // IV index
 exports.hex_iv_index = "12345677";
+// Further NetKeys and AppKeys, to decode the messages of other subnets and applications;
+// messages are sent with hex_netkey and hex_appkey
+exports.hex_extra_netkeys = [];
+exports.hex_extra_appkeys = [];
+
+// AES implementation: "native" (Node's OpenSSL, default) or "asmcrypto" (pure JS)
+exports.crypto_backend = "native";
+// worker threads decrypting network PDUs, 0 to decrypt on the main thread
+exports.crypto_workers = 0;
+
+// Prometheus metrics endpoint, http://<metrics_host>:<metrics_port>/metrics; comment out to disable
+exports.metrics_port = 9464;
+// Address the endpoint listens on, localhost if not set
+exports.metrics_host = "127.0.0.1";
+// Record every GATT notification to this file, to be replayed with trace_replay.js
+// exports.capture_file = "capture.trace";
 
 // RPi mesh network address
 exports.hex_rpi_addr = "7FFF";
@@ -17,9 +33,34 @@ exports.hex_LED_alert_target = "FFFF";
 // MQTT publishing data
 exports.mqtt_url = "mqtts://iot.wussler.it";
 exports.mqtt_token = "w7SohHdkRf2ZVvKv";
+// Telemetry batching: readings are published together when this many are queued...
+exports.mqtt_batch_size = 20;
+// ...or this many ms after the first queued reading
+exports.mqtt_batch_interval = 1000;
+// Publish as a ThingsBoard gateway, with a device for each mesh node named after address_map;
+// mqtt_token is then the token of a gateway device
+exports.mqtt_gateway = false;
+// Outbox directory where telemetry is stored while MQTT is disconnected
+exports.outbox_dir = "outbox";
+// Outbox size cap in bytes, the oldest telemetry is dropped first when full
+exports.outbox_max_bytes = 10 * 1024 * 1024;
+// Publishes per second when draining the outbox after a reconnection
+exports.outbox_drain_rate = 10;
+
+// Replay protection list file; comment out to keep the list in memory only
+exports.rpl_file = "rpl";
+// IV index from the last Mesh Beacon, so that proxy links are usable right after connecting
+exports.iv_index_file = "iv_index";
 
 // Proxy node IDs
 exports.proxy_ids = ['d1e174cea07c'];
+// Number of proxies to stay connected to at once, all of proxy_ids if not set
+exports.proxy_links = 2;
+// Proxy filter: "accept" forwards only messages sent to the bridge and to proxy_filter_addresses
+// (the sensors publication address), "reject" drops messages sent to the nodes in address_map;
+// comment out to leave the proxy filter untouched
+exports.proxy_filter = "accept";
+exports.proxy_filter_addresses = ['FFFF'];
 
 // Mapping mesh addresses to names
 // Format: <mesh address>: <human readable name>
@@ -1,5 +1,3 @@
-var asmCrypto = require('./asmcrypto.all');
-var aesCmac = require('node-aes-cmac').aesCmac;
 var utils = require('./utils.js');
 var bigInt = require("big-integer");
 
@@ -10,15 +8,37 @@ var k4_salt;
 var id64_hex;
 var id6_hex;
 
+// AES backend, selected in init(): 'native' (OpenSSL, default) or 'asmcrypto' (pure JS)
+var backend = null;
+// key contexts of the hex API, built once per key
+var key_contexts = new Map();
+
+function createKey(key) {
+	return backend.createKey(key);
+}
+
+function keyContext(hex_key) {
+	var ctx = key_contexts.get(hex_key);
+	if (ctx === undefined) {
+		ctx = backend.createKey(Buffer.from(hex_key, 'hex'));
+		key_contexts.set(hex_key, ctx);
+	}
+	return ctx;
+}
+
 function getAesCmac(hex_key, hex_message) {
-	// aesCmac function requires Buffer objects
-	b_key = Buffer.from(hex_key, 'hex');
-	b_message = Buffer.from(hex_message, 'hex');
-	return aesCmac(b_key, b_message);
+	return backend.cmac(keyContext(hex_key), Buffer.from(hex_message, 'hex')).toString('hex');
 }
 
-function init() {
+function init(backend_name) {
 	console.log("Initialising crypto variables...");
+	if (backend_name == 'asmcrypto') {
+		backend = require('./crypto_asmcrypto.js');
+	} else {
+		backend = require('./crypto_native.js');
+	}
+	key_contexts.clear();
+	console.log("Crypto backend: " + backend.name);
 	ZERO = '00000000000000000000000000000000';
 	k2_salt = s1("736d6b32"); // "smk2"
 	k3_salt = s1("736d6b33"); // "smk3"
@@ -46,12 +66,17 @@ function init() {
 function e(hex_plaintext, hex_key) {
 	// console.log("AEC-ECB(" + hex_plaintext + "," + hex_key + ")");
 
-	var hex_padding = "";
-	var ecb_encrypted = asmCrypto.AES_ECB.encrypt(asmCrypto.hex_to_bytes(hex_plaintext), asmCrypto.hex_to_bytes(hex_key), asmCrypto.hex_to_bytes(hex_padding));
+	var ecb_encrypted = backend.ecb(keyContext(hex_key), Buffer.from(hex_plaintext, 'hex'));
 
-	return asmCrypto.bytes_to_hex(ecb_encrypted);
+	return utils.u8AToHexString(ecb_encrypted);
 };
 
+// bytes in, bytes out variant of e(), used by the decoder to avoid hex conversions.
+// key is a context returned by createKey()
+function eBytes(plaintext, key) {
+	return backend.ecb(key, plaintext);
+}
+
 function s1(M) {
 	cmac = getAesCmac(ZERO, M);
 	// result is a hex encoded string
@@ -154,8 +179,7 @@ function decryptAndVerify(hex_key, hex_cipher, hex_nonce, tag_size) {
 		error: ""
 	}
 	try {
-		var adata = new Uint8Array([ ]);
-		dec = asmCrypto.AES_CCM.decrypt( utils.hexToU8A(hex_cipher), utils.hexToU8A(hex_key), utils.hexToU8A(hex_nonce), adata, tag_size);
+		dec = backend.ccmDecrypt(keyContext(hex_key), utils.hexToU8A(hex_nonce), utils.hexToU8A(hex_cipher), tag_size);
 		hex_dec = utils.u8AToHexString(dec);
 		dec_ver_result.hex_decrypted = hex_dec;
 	} catch (err) {
@@ -166,6 +190,23 @@ function decryptAndVerify(hex_key, hex_cipher, hex_nonce, tag_size) {
 	return dec_ver_result;
 }
 
+// bytes in, bytes out variant of decryptAndVerify; the result holds a Uint8Array.
+// key is a context returned by createKey()
+function decryptAndVerifyBytes(key, cipher, nonce, tag_size) {
+	var result = {
+		decrypted: null,
+		status: 0,
+		error: ""
+	}
+	try {
+		result.decrypted = backend.ccmDecrypt(key, nonce, cipher, tag_size);
+	} catch (err) {
+		result.status = -1;
+		result.error = err;
+	}
+	return result;
+}
+
 function obfuscate(enc_dst, enc_transport_pdu, netmic, ctl, ttl, seq, src, iv_index, privacy_key) {
 	//1. Create Privacy Random
 	hex_privacy_random = privacyRandom(enc_dst, enc_transport_pdu, netmic);
@@ -223,7 +264,9 @@ function deobfuscate(obfuscated_data, iv_index, netkey, privacy_random, privacy_
 	return result;
 }
 
-function meshAuthEncNetwork(hex_encryption_key, hex_nonce, hex_dst, hex_transport_pdu) {
+// netmic_size is 4 bytes, or 8 for control messages
+function meshAuthEncNetwork(hex_encryption_key, hex_nonce, hex_dst, hex_transport_pdu, netmic_size) {
+	netmic_size = netmic_size || 4;
 	let arg3 = hex_dst + hex_transport_pdu;
 	let result = {
 		Encryption_Key: hex_encryption_key,
@@ -231,29 +274,29 @@ function meshAuthEncNetwork(hex_encryption_key, hex_nonce, hex_dst, hex_transpor
 		EncTransportPDU: 0,
 		NetMIC: 0
 	};
-	u8_key = utils.hexToU8A(hex_encryption_key);
 	u8_nonce = utils.hexToU8A(hex_nonce);
 	u8_dst_plus_transport_pdu = utils.hexToU8A(arg3);
-	auth_enc_network = asmCrypto.AES_CCM.encrypt(u8_dst_plus_transport_pdu, u8_key, u8_nonce, new Uint8Array([]), 4);
+	auth_enc_network = backend.ccmEncrypt(keyContext(hex_encryption_key), u8_nonce, u8_dst_plus_transport_pdu, netmic_size);
 	hex = utils.u8AToHexString(auth_enc_network);
 	result.EncDST = hex.substring(0, 4);
-	result.EncTransportPDU = hex.substring(4, hex.length - 8);
-	result.NetMIC = hex.substring(hex.length - 8, hex.length);
+	result.EncTransportPDU = hex.substring(4, hex.length - netmic_size * 2);
+	result.NetMIC = hex.substring(hex.length - netmic_size * 2, hex.length);
 	return result;
 }
 
-function meshAuthEncAccessPayload(hex_appkey, hex_nonce, hex_payload) {
-	u8_key = utils.hexToU8A(hex_appkey);
+// transmic_size is 4 bytes, or 8 for segmented messages with SZMIC set
+function meshAuthEncAccessPayload(hex_appkey, hex_nonce, hex_payload, transmic_size) {
+	transmic_size = transmic_size || 4;
 	u8_nonce = utils.hexToU8A(hex_nonce);
 	u8_payload = utils.hexToU8A(hex_payload);
 	var result = {
 		EncAccessPayload: 0,
 		TransMIC: 0
 	};
-	auth_enc_access = asmCrypto.AES_CCM.encrypt(u8_payload, u8_key, u8_nonce, new Uint8Array([]), 4);
+	auth_enc_access = backend.ccmEncrypt(keyContext(hex_appkey), u8_nonce, u8_payload, transmic_size);
 	hex = utils.u8AToHexString(auth_enc_access);
-	result.EncAccessPayload = hex.substring(0, hex.length - 8);
-	result.TransMIC = hex.substring(hex.length - 8, hex.length);
+	result.EncAccessPayload = hex.substring(0, hex.length - transmic_size * 2);
+	result.TransMIC = hex.substring(hex.length - transmic_size * 2, hex.length);
 	return result;
 };
 
@@ -262,9 +305,12 @@ module.exports.k2 = k2;
 module.exports.k3 = k3;
 module.exports.k4 = k4;
 module.exports.init = init;
+module.exports.createKey = createKey;
 module.exports.privacyRandom = privacyRandom;
 module.exports.deobfuscate = deobfuscate;
 module.exports.obfuscate = obfuscate;
 module.exports.decryptAndVerify = decryptAndVerify;
+module.exports.decryptAndVerifyBytes = decryptAndVerifyBytes;
+module.exports.eBytes = eBytes;
 module.exports.meshAuthEncNetwork = meshAuthEncNetwork;
 module.exports.meshAuthEncAccessPayload = meshAuthEncAccessPayload;
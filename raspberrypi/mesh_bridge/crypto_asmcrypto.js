@@ -0,0 +1,38 @@
+// Crypto backend using the pure-JS asmcrypto bundle and node-aes-cmac.
+// Kept as a fallback and as the baseline for bench_crypto.js.
+
+var asmCrypto = require('./asmcrypto.all');
+var aesCmac = require('node-aes-cmac').aesCmac;
+
+var EMPTY_ADATA = new Uint8Array([]);
+
+function createKey(key) {
+	return {
+		key: Uint8Array.from(key)
+	};
+}
+
+// AES-128 of a single 16 bytes block
+function ecb(ctx, block) {
+	return asmCrypto.AES_ECB.encrypt(block, ctx.key);
+}
+
+function ccmEncrypt(ctx, nonce, plaintext, tag_size) {
+	return asmCrypto.AES_CCM.encrypt(plaintext, ctx.key, nonce, EMPTY_ADATA, tag_size);
+}
+
+// ciphertext includes the authentication tag; throws if the tag doesn't verify
+function ccmDecrypt(ctx, nonce, ciphertext, tag_size) {
+	return asmCrypto.AES_CCM.decrypt(ciphertext, ctx.key, nonce, EMPTY_ADATA, tag_size);
+}
+
+function cmac(ctx, message) {
+	return aesCmac(Buffer.from(ctx.key), Buffer.from(message), { returnAsBuffer: true });
+}
+
+module.exports.name = 'asmcrypto';
+module.exports.createKey = createKey;
+module.exports.ecb = ecb;
+module.exports.ccmEncrypt = ccmEncrypt;
+module.exports.ccmDecrypt = ccmDecrypt;
+module.exports.cmac = cmac;
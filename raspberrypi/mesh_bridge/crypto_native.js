@@ -0,0 +1,93 @@
+// Crypto backend using Node's built-in OpenSSL bindings.
+// A key context holds the parsed KeyObject and a long-lived AES-ECB cipher, so the
+// key is imported once and single block encryptions (PECB, CMAC) don't rebuild a cipher.
+
+var nodeCrypto = require('crypto');
+
+var ZERO_BLOCK = Buffer.alloc(16);
+
+function createKey(key) {
+	var key_object = nodeCrypto.createSecretKey(Buffer.from(key));
+	var ecb = nodeCrypto.createCipheriv('aes-128-ecb', key_object, null);
+	ecb.setAutoPadding(false);
+	return {
+		key_object: key_object,
+		ecb: ecb
+	};
+}
+
+// AES-128 of a single 16 bytes block
+function ecb(ctx, block) {
+	return ctx.ecb.update(block);
+}
+
+function ccmEncrypt(ctx, nonce, plaintext, tag_size) {
+	var cipher = nodeCrypto.createCipheriv('aes-128-ccm', ctx.key_object, nonce, { authTagLength: tag_size });
+	var encrypted = cipher.update(plaintext);
+	cipher.final();
+	return Buffer.concat([encrypted, cipher.getAuthTag()]);
+}
+
+// ciphertext includes the authentication tag; throws if the tag doesn't verify
+function ccmDecrypt(ctx, nonce, ciphertext, tag_size) {
+	if (ciphertext.length < tag_size) {
+		throw new Error("illegal dataLength value");
+	}
+	var decipher = nodeCrypto.createDecipheriv('aes-128-ccm', ctx.key_object, nonce, { authTagLength: tag_size });
+	decipher.setAuthTag(ciphertext.subarray(ciphertext.length - tag_size));
+	var decrypted = decipher.update(ciphertext.subarray(0, ciphertext.length - tag_size));
+	try {
+		decipher.final();
+	} catch (err) {
+		throw new Error("data integrity check failed");
+	}
+	return decrypted;
+}
+
+// RFC 4493 subkey generation: left shift by one bit, xor Rb if the msb was set
+function cmacSubkey(block) {
+	var subkey = Buffer.alloc(16);
+	for (var i = 0; i < 16; i++) {
+		subkey[i] = (block[i] << 1) | (i < 15 ? block[i + 1] >> 7 : 0);
+	}
+	if (block[0] & 0x80) {
+		subkey[15] ^= 0x87;
+	}
+	return subkey;
+}
+
+// AES-CMAC (RFC 4493)
+function cmac(ctx, message) {
+	if (!ctx.k1) {
+		ctx.k1 = cmacSubkey(ecb(ctx, ZERO_BLOCK));
+		ctx.k2 = cmacSubkey(ctx.k1);
+	}
+
+	var n = Math.max(1, Math.ceil(message.length / 16));
+	var complete = message.length > 0 && message.length % 16 == 0;
+	var x = ZERO_BLOCK;
+	var y = Buffer.alloc(16);
+
+	for (var i = 0; i < n - 1; i++) {
+		for (var j = 0; j < 16; j++) {
+			y[j] = x[j] ^ message[i * 16 + j];
+		}
+		x = ecb(ctx, y);
+	}
+
+	// last block, padded with 10..0 if incomplete
+	var last = message.subarray((n - 1) * 16);
+	var subkey = complete ? ctx.k1 : ctx.k2;
+	for (var j = 0; j < 16; j++) {
+		var m = j < last.length ? last[j] : (j == last.length ? 0x80 : 0);
+		y[j] = x[j] ^ m ^ subkey[j];
+	}
+	return ecb(ctx, y);
+}
+
+module.exports.name = 'native';
+module.exports.createKey = createKey;
+module.exports.ecb = ecb;
+module.exports.ccmEncrypt = ccmEncrypt;
+module.exports.ccmDecrypt = ccmDecrypt;
+module.exports.cmac = cmac;
@@ -0,0 +1,235 @@
+//--------------------------------------------------------------
+// Crypto worker pool
+// Deobfuscation and network and access layer decryption run in
+// worker threads, off the event loop that serves GATT and MQTT.
+// Network PDUs are posted in batches and their results are
+// delivered in submission order through a reorder buffer, so the
+// per-source order the replay protection list and reassembly
+// rely on is the order of reception. Past HIGH_WATER PDUs in
+// flight the pool is saturated: new PDUs are refused and the
+// pressure handler is told, until the backlog drains to LOW_WATER.
+// If a worker dies, the PDUs it holds are dropped with reason
+// "worker" so that delivery goes on, and a new worker is started
+// after RESPAWN_DELAY.
+//--------------------------------------------------------------
+const { Worker } = require('worker_threads');
+const path = require('path');
+
+// PDUs per message to a worker
+const BATCH_SIZE = 32;
+// PDUs in flight above which the pool is saturated, and below which it isn't anymore
+const HIGH_WATER = 512;
+const LOW_WATER = 128;
+// ms before a dead worker is replaced, so that a worker failing at start doesn't spin
+const RESPAWN_DELAY = 1000;
+
+let workers = []; // {worker, in_flight, tickets: tickets posted and not answered yet, alive}
+let worker_data = null;
+let closing = false;
+let pressure_handler = null;
+let saturated = false;
+
+// submission tickets: callbacks by ticket, results waiting for an earlier ticket
+let next_ticket = 0;
+let next_delivery = 0;
+let callbacks = new Map();
+let results = new Map();
+let batch = [];
+let flush_scheduled = false;
+
+let stats = {
+  submitted: 0,
+  batches: 0,
+  refused: 0,
+  max_in_flight: 0,
+  saturations: 0,
+  worker_failures: 0
+};
+
+// start count workers; data: {crypto_backend, keys: [netkeys, appkeys], iv_index}, see decoder.setKeys()
+function init(count, data) {
+  worker_data = data;
+  closing = false;
+  for (let i = 0; i < count; i++) {
+    let entry = { worker: null, in_flight: 0, tickets: new Set(), alive: false };
+    workers.push(entry);
+    spawn(entry);
+  }
+}
+
+function spawn(entry) {
+  entry.worker = new Worker(path.join(__dirname, 'crypto_worker.js'), { workerData: worker_data });
+  entry.alive = true;
+  entry.worker.on('message', message => onResults(entry, message));
+  entry.worker.on('error', err => console.log("ERROR: crypto worker: " + err.message));
+  entry.worker.on('exit', code => onExit(entry, code));
+}
+
+// drop the PDUs of a dead worker and replace it
+function onExit(entry, code) {
+  entry.alive = false;
+  if (closing) {
+    return;
+  }
+  stats.worker_failures++;
+  console.log(`ERROR: crypto worker exited with code ${code}, dropping ${entry.tickets.size} PDUs`);
+  fail(entry.tickets, "crypto worker exited");
+  entry.tickets.clear();
+  entry.in_flight = 0;
+  setTimeout(() => {
+    if (!closing) {
+      spawn(entry);
+    }
+  }, RESPAWN_DELAY);
+}
+
+// deliver tickets as dropped, in the shape of decoder.decryptNetworkPdu() results
+function fail(tickets, error) {
+  for (let ticket of tickets) {
+    results.set(ticket, { reason: "worker", error: error, ctl: 0, ttl: 0, seq: 0, src: 0, dst: 0,
+      netkey_index: -1, lower_transport_pdu: null, app_result: null });
+  }
+  deliver();
+}
+
+function size() {
+  return workers.length;
+}
+
+// handler(saturated) is called when the pool becomes saturated and when it recovers
+function setPressureHandler(handler) {
+  pressure_handler = handler;
+}
+
+// PDUs already submitted are decrypted with the previous IV index
+function setIvIndex(hex_iv_index) {
+  flush();
+  worker_data = Object.assign({}, worker_data, { iv_index: hex_iv_index });
+  for (let entry of workers.filter(e => e.alive)) {
+    entry.worker.postMessage({ type: 'iv_index', iv_index: hex_iv_index });
+  }
+}
+
+// queue a network PDU for decryption, callback(out) with the result of decoder.decryptNetworkPdu().
+// Returns false if the pool is saturated and the PDU has been refused
+function submit(network_pdu, msgtype, callback) {
+  if (callbacks.size >= HIGH_WATER) {
+    setSaturated(true);
+    stats.refused++;
+    return false;
+  }
+
+  let ticket = next_ticket++;
+  callbacks.set(ticket, callback);
+  batch.push({ ticket: ticket, network_pdu: network_pdu, msgtype: msgtype });
+  stats.submitted++;
+  stats.max_in_flight = Math.max(stats.max_in_flight, callbacks.size);
+  if (callbacks.size >= HIGH_WATER) {
+    setSaturated(true);
+  }
+
+  if (batch.length >= BATCH_SIZE) {
+    flush();
+  } else if (!flush_scheduled) {
+    // PDUs received in the same event loop turn go in one batch
+    flush_scheduled = true;
+    setImmediate(flush);
+  }
+  return true;
+}
+
+// post the pending batch to the least loaded worker, or drop it if no worker is running
+function flush() {
+  flush_scheduled = false;
+  if (batch.length == 0) {
+    return;
+  }
+  let pdus = batch;
+  batch = [];
+  let alive = workers.filter(e => e.alive);
+  if (alive.length == 0) {
+    // not from within submit(): callers get their results asynchronously
+    setImmediate(() => fail(pdus.map(pdu => pdu.ticket), "no crypto worker running"));
+    return;
+  }
+  let entry = alive.reduce((best, e) => e.in_flight < best.in_flight ? e : best);
+  entry.in_flight += pdus.length;
+  pdus.forEach(pdu => entry.tickets.add(pdu.ticket));
+  entry.worker.postMessage({ type: 'batch', pdus: pdus });
+  stats.batches++;
+}
+
+function onResults(entry, message) {
+  entry.in_flight -= message.results.length;
+  for (let result of message.results) {
+    entry.tickets.delete(result.ticket);
+    results.set(result.ticket, result.out);
+  }
+  deliver();
+}
+
+// call back the results in submission order, as far as they are available
+function deliver() {
+  while (results.has(next_delivery)) {
+    let out = results.get(next_delivery);
+    let callback = callbacks.get(next_delivery);
+    results.delete(next_delivery);
+    callbacks.delete(next_delivery);
+    next_delivery++;
+    callback(out);
+  }
+
+  if (saturated && callbacks.size <= LOW_WATER) {
+    setSaturated(false);
+  }
+}
+
+function setSaturated(value) {
+  if (value == saturated) {
+    return;
+  }
+  saturated = value;
+  if (value) {
+    stats.saturations++;
+  }
+  if (pressure_handler) {
+    pressure_handler(value);
+  }
+}
+
+function isSaturated() {
+  return saturated;
+}
+
+function inFlight() {
+  return callbacks.size;
+}
+
+function close() {
+  closing = true;
+  return Promise.all(workers.map(entry => entry.worker.terminate())).then(() => {
+    workers = [];
+  });
+}
+
+// stop a worker as if it had crashed, for fault injection (trace_replay.js --kill-worker)
+function kill(index) {
+  if (index < workers.length && workers[index].alive) {
+    workers[index].worker.terminate();
+  }
+}
+
+function getStats() {
+  return stats;
+}
+
+module.exports.init = init;
+module.exports.size = size;
+module.exports.setPressureHandler = setPressureHandler;
+module.exports.setIvIndex = setIvIndex;
+module.exports.submit = submit;
+module.exports.isSaturated = isSaturated;
+module.exports.inFlight = inFlight;
+module.exports.close = close;
+module.exports.kill = kill;
+module.exports.getStats = getStats;
@@ -0,0 +1,30 @@
+//--------------------------------------------------------------
+// Crypto worker thread, see crypto_pool.js
+// Runs the crypto stage of the decoder on batches of network
+// PDUs. The worker has its own key table and IV index; the
+// replay protection list, the network message cache and the
+// reassembly state stay on the main thread.
+//--------------------------------------------------------------
+const { parentPort, workerData } = require('worker_threads');
+const crypto = require('./crypto.js');
+const decoder = require('./decoder.js');
+
+// the main thread has already logged the crypto setup
+const log = console.log;
+console.log = () => {};
+crypto.init(workerData.crypto_backend);
+console.log = log;
+decoder.setKeys(...workerData.keys);
+decoder.setIvIndex(workerData.iv_index);
+
+parentPort.on('message', message => {
+  if (message.type == 'iv_index') {
+    decoder.setIvIndex(message.iv_index);
+  } else if (message.type == 'batch') {
+    let results = message.pdus.map(pdu => ({
+      ticket: pdu.ticket,
+      out: decoder.decryptNetworkPdu(pdu.network_pdu, pdu.msgtype)
+    }));
+    parentPort.postMessage({ results: results });
+  }
+});
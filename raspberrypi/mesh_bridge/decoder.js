@@ -0,0 +1,617 @@
+//--------------------------------------------------------------
+// Proxy PDU decoder
+// Works on byte buffers from the proxy PDU down to the access
+// payload: fields are read as integers and subarrays are used
+// instead of hex string copies.
+//--------------------------------------------------------------
+const crypto = require('./crypto.js');
+const replay = require('./replay.js');
+const reassembly = require('./reassembly.js');
+const key_table = require('./key_table.js');
+
+// decode result status
+const DECODE_OK = 0;         // access payload decrypted
+const DECODE_INCOMPLETE = 1; // waiting for further proxy or lower transport segments
+const DECODE_BEACON = 2;     // mesh beacon, see result.beacon
+const DECODE_DROPPED = 3;    // PDU discarded, see result.reason
+const DECODE_CONTROL = 4;    // unsegmented control message, see result.opcode and result.params
+const DECODE_PROXY_CONFIG = 5; // proxy configuration message, see result.opcode and result.params
+
+// NetKeys and AppKeys indexed by NID and AID, built once by setKeys()
+let keys = null;
+let iv_index = new Uint8Array(4);
+let iv_index_int = 0;
+
+// preallocated crypto inputs, see 3.8.7.3 and 3.8.5
+const pecb_input = new Uint8Array(16);
+const network_nonce = new Uint8Array(13);
+const app_nonce = new Uint8Array(13);
+
+// network message cache (3.4.6.5): obfuscated header and NetMIC of the latest
+// authenticated network PDUs, so that relayed and retransmitted copies are
+// dropped before any AES operation. Oldest entries are evicted first.
+const NETWORK_CACHE_SIZE = 256;
+let network_cache = new Map();
+
+// decoder counters, see getStats()
+let stats = {
+  cache_hits: 0,
+  cache_misses: 0,
+  nid_rejects: 0,
+  length_rejects: 0,
+  overload_drops: 0,
+  // keys tried after the first candidate of a NID or AID, see key_table.js
+  key_retries: 0
+};
+
+// proxy SAR state of the GATT link, when the caller doesn't provide one
+let default_link = reassembly.createProxyReassembly();
+
+// crypto worker pool used by submitProxyPdu(), see crypto_pool.js
+let pool = null;
+
+// observer(stage, seconds) of the time spent in each decoding stage, null when not measured
+let stage_observer = null;
+
+function newResult() {
+  return {
+    status: DECODE_DROPPED,
+    reason: "",
+    error: "",
+    sar: 0,
+    msgtype: 0,
+    ivi: 0,
+    nid: 0,
+    ctl: 0,
+    ttl: 0,
+    seq: 0,
+    src: 0,
+    dst: 0,
+    seg: 0,
+    akf: 0,
+    aid: 0,
+    szmic: 0,
+    netkey_index: -1,
+    appkey_index: -1,
+    opcode: -1,
+    company_code: -1,
+    params: null,
+    transmic: null,
+    netmic: null,
+    beacon: null
+  };
+}
+
+// exact cache key of 10 bytes: obfuscated CTL TTL SEQ SRC and NetMIC, packed in 16-bit chars
+function networkCacheKey(network_pdu) {
+  let n = network_pdu.length;
+  return String.fromCharCode(
+    (network_pdu[1] << 8) | network_pdu[2],
+    (network_pdu[3] << 8) | network_pdu[4],
+    (network_pdu[5] << 8) | network_pdu[6],
+    (network_pdu[n - 4] << 8) | network_pdu[n - 3],
+    (network_pdu[n - 2] << 8) | network_pdu[n - 1]
+  );
+}
+
+function networkCacheAdd(key) {
+  network_cache.set(key, true);
+  if (network_cache.size > NETWORK_CACHE_SIZE) {
+    network_cache.delete(network_cache.keys().next().value);
+  }
+}
+
+function getStats() {
+  return stats;
+}
+
+function setPool(crypto_pool) {
+  pool = crypto_pool;
+}
+
+function setStageObserver(observer) {
+  stage_observer = observer;
+}
+
+function stageStart() {
+  return stage_observer ? process.hrtime.bigint() : 0n;
+}
+
+// report the time since start for the stage, returns the start of the next one
+function stageEnd(stage, start) {
+  if (stage_observer == null) {
+    return 0n;
+  }
+  let now = process.hrtime.bigint();
+  stage_observer(stage, Number(now - start) / 1e9);
+  return now;
+}
+
+// forget the network message cache and counters, e.g. between benchmark runs
+function reset() {
+  network_cache.clear();
+  for (let key in stats) {
+    stats[key] = 0;
+  }
+}
+
+function drop(result, reason, error) {
+  result.status = DECODE_DROPPED;
+  result.reason = reason;
+  result.error = error || "";
+  return result;
+}
+
+// NetKeys and AppKeys are given as lists of hex strings, as stored in config.js
+function setKeys(hex_netkeys, hex_appkeys) {
+  keys = key_table.create(hex_netkeys, hex_appkeys);
+}
+
+function setIvIndex(hex_iv_index) {
+  iv_index = Buffer.from(hex_iv_index, 'hex');
+  iv_index_int = iv_index.readUInt32BE(0);
+  pecb_input.set(iv_index, 5);
+  network_nonce.set(iv_index, 9);
+  app_nonce.set(iv_index, 9);
+}
+
+// ref 3.7.3.1
+function getOpcodeAndParams(access_payload, result) {
+  if (access_payload.length < 1) {
+    return false;
+  }
+
+  let byte1 = access_payload[0];
+  if ((byte1 & 0x7F) == 0x7F) {
+    return false;
+  }
+
+  let opcode_len = 1;
+  if ((byte1 & 0x80) == 0x80) {
+    opcode_len = (byte1 & 0x40) == 0x40 ? 3 : 2;
+  }
+  if (access_payload.length < opcode_len) {
+    return false;
+  }
+
+  if (opcode_len == 3) {
+    result.opcode = byte1;
+    // company identifier, little endian
+    result.company_code = access_payload[1] | (access_payload[2] << 8);
+  } else if (opcode_len == 2) {
+    result.opcode = (byte1 << 8) | access_payload[1];
+  } else {
+    result.opcode = byte1;
+  }
+  result.params = access_payload.subarray(opcode_len);
+  return true;
+}
+
+// unsegmented control message: 3.5.2.3, e.g. Segment Acknowledgment
+function decodeControl(result, lower_transport_pdu) {
+  result.seg = (lower_transport_pdu[0] & 0x80) >> 7;
+  if (result.seg == 1) {
+    return drop(result, "unsupported", "Segmented control messages are not supported");
+  }
+  if (replay.isReplay(result.src, iv_index_int, result.seq)) {
+    return drop(result, "replay");
+  }
+  // authenticated by the NetMIC
+  replay.update(result.src, iv_index_int, result.seq);
+
+  result.opcode = lower_transport_pdu[0] & 0x7F;
+  result.params = lower_transport_pdu.subarray(1);
+  result.status = DECODE_CONTROL;
+  return result;
+}
+
+//----------------------------------
+// Proxy PDU Decryption function
+// link holds the proxy SAR state of the GATT link the PDU has been received from,
+// see reassembly.createProxyReassembly()
+//----------------------------------
+function decodeProxyPdu(octets, link) {
+  let result = newResult();
+  let time = stageStart();
+  let network_pdu = unwrapProxyPdu(octets, link || default_link, result);
+  time = stageEnd("unwrap", time);
+  if (network_pdu == null) {
+    return result;
+  }
+
+  let lower_transport_pdu = decryptNetwork(network_pdu, result);
+  time = stageEnd("network", time);
+  if (lower_transport_pdu == null) {
+    return result;
+  }
+  decodeLowerTransport(network_pdu, lower_transport_pdu, result, null);
+  stageEnd("transport", time);
+  return result;
+}
+
+// Same as decodeProxyPdu(), with the crypto stage run by the worker pool (see crypto_pool.js).
+// callback(result) is called in submission order; it is called right away for PDUs that don't
+// need decryption, e.g. beacons and drops, and not at all for incomplete proxy PDUs
+function submitProxyPdu(octets, link, callback) {
+  let result = newResult();
+  let time = stageStart();
+  let network_pdu = unwrapProxyPdu(octets, link || default_link, result);
+  time = stageEnd("unwrap", time);
+  if (network_pdu == null) {
+    if (result.status != DECODE_INCOMPLETE) {
+      callback(result);
+    }
+    return;
+  }
+
+  // the proxy SAR buffer is reused by the next PDU of the link
+  network_pdu = Uint8Array.from(network_pdu);
+  let accepted = pool.submit(network_pdu, result.msgtype, out => {
+    time = stageEnd("pool", time);
+    result.ctl = out.ctl;
+    result.ttl = out.ttl;
+    result.seq = out.seq;
+    result.src = out.src;
+    result.dst = out.dst;
+    result.netkey_index = out.netkey_index;
+    if (out.lower_transport_pdu == null) {
+      callback(drop(result, out.reason, out.error));
+      return;
+    }
+    result.netmic = network_pdu.subarray(network_pdu.length - (result.ctl == 1 ? 8 : 4));
+    decodeLowerTransport(network_pdu, out.lower_transport_pdu, result, out.app_result);
+    stageEnd("transport", time);
+    callback(result);
+  });
+  if (!accepted) {
+    stats.overload_drops++;
+    callback(drop(result, "overload"));
+  }
+}
+
+// Crypto stage, run by the pool workers: deobfuscation, network decryption and, for
+// unsegmented access messages, application decryption. Returns a cloneable object
+function decryptNetworkPdu(network_pdu, msgtype) {
+  let result = newResult();
+  result.msgtype = msgtype;
+  result.nid = network_pdu[0] & 0x7F;
+  let lower_transport_pdu = decryptNetwork(network_pdu, result);
+
+  let out = {
+    reason: result.reason,
+    error: result.error,
+    ctl: result.ctl,
+    ttl: result.ttl,
+    seq: result.seq,
+    src: result.src,
+    dst: result.dst,
+    netkey_index: result.netkey_index,
+    lower_transport_pdu: null,
+    app_result: null
+  };
+  if (lower_transport_pdu == null) {
+    return out;
+  }
+  out.lower_transport_pdu = Uint8Array.from(lower_transport_pdu);
+
+  if (result.msgtype == 0 && result.ctl == 0 && (lower_transport_pdu[0] & 0x80) == 0 && lower_transport_pdu.length > 5) {
+    result.akf = (lower_transport_pdu[0] & 0x40) >> 6;
+    result.aid = lower_transport_pdu[0] & 0x3F;
+    let app_result = decryptAccess(result, lower_transport_pdu.subarray(1), result.seq, 4);
+    out.app_result = {
+      status: app_result.status,
+      decrypted: app_result.decrypted,
+      appkey_index: result.appkey_index,
+      error: app_result.error ? { message: app_result.error.message } : null
+    };
+  }
+  return out;
+}
+
+// proxy SAR, proxy PDU type and the checks that don't need any crypto operation.
+// Returns the network PDU, or null if there's nothing to decrypt (see result.status)
+function unwrapProxyPdu(octets, link, result) {
+  // length validation
+  if (octets.length < 1) {
+    drop(result, "empty", "Error: No data received");
+    return null;
+  }
+
+  // -----------------------------------------------------
+  // 1. Extract proxy PDU fields : SAR, msgtype, data
+  // -----------------------------------------------------
+  let sar_msgtype = octets[0];
+  result.sar = (sar_msgtype & 0xC0) >> 6;
+
+  // PDU segmentation
+  if (result.sar == 1) {
+    if (!reassembly.proxyStart(link, octets)) {
+      drop(result, "malformed", "ERROR: proxy PDU too long");
+      return null;
+    }
+    result.status = DECODE_INCOMPLETE;
+    return null;
+  } else if (result.sar == 2 || result.sar == 3) {
+    if (!reassembly.proxyAppend(link, octets.subarray(1))) {
+      drop(result, "malformed", "ERROR: proxy PDU concatenation error");
+      return null;
+    }
+    if (result.sar == 2) {
+      result.status = DECODE_INCOMPLETE;
+      return null;
+    }
+    octets = reassembly.proxyFinish(link);
+  }
+
+  result.msgtype = sar_msgtype & 0x3F;
+  if (result.msgtype > 3) {
+    drop(result, "malformed", "Message Type contains invalid value. 0x00-0x03 allowed. Ref Table 6.3");
+    return null;
+  } else if (result.msgtype == 1) {
+    // mesh beacon received
+    result.status = DECODE_BEACON;
+    result.beacon = octets.subarray(1);
+    return null;
+  }
+
+  // See table 3.7 for min length of network PDU and 6.1 for proxy PDU length
+  if (octets.length < 15) {
+    stats.length_rejects++;
+    drop(result, "malformed", "PDU is too short (min 15 bytes) - " + octets.length + " bytes received");
+    return null;
+  }
+  if (octets.length > 30) {
+    stats.length_rejects++;
+    drop(result, "malformed", "PDU is too long (max 29 bytes network PDU) - " + octets.length + " bytes received");
+    return null;
+  }
+
+  // demarshall obfuscated network pdu
+  let network_pdu = octets.subarray(1);
+  result.ivi = (network_pdu[0] & 0x80) >> 7;
+  result.nid = network_pdu[0] & 0x7F;
+
+  // 3.4.6.3 Receiving a Network PDU
+  // Upon receiving a message, the node shall check if the value of the NID field value matches one or more known NIDs
+  if (key_table.subnets(keys, result.nid).length == 0) {
+    stats.nid_rejects++;
+    drop(result, "nid", "ERROR:unknown NID. Discarding message.");
+    return null;
+  }
+
+  // drop PDUs already received, e.g. network retransmissions
+  if (network_cache.has(networkCacheKey(network_pdu))) {
+    stats.cache_hits++;
+    drop(result, "duplicate");
+    return null;
+  }
+  stats.cache_misses++;
+  return network_pdu;
+}
+
+// deobfuscate, decrypt and verify the network PDU with the keys of its NID. Returns the
+// lower transport PDU, or null if the PDU is dropped
+function decryptNetwork(network_pdu, result) {
+  let subnets = key_table.subnets(keys, result.nid);
+  for (let i = 0; i < subnets.length; i++) {
+    if (i > 0) {
+      stats.key_retries++;
+    }
+    let lower_transport_pdu = decryptNetworkWith(subnets[i], network_pdu, result);
+    if (lower_transport_pdu != null) {
+      result.netkey_index = subnets[i].index;
+      return lower_transport_pdu;
+    }
+  }
+  // the drop reason is the one of the last key tried
+  return null;
+}
+
+function decryptNetworkWith(subnet, network_pdu, result) {
+  let obfuscated_ctl_ttl_seq_src = network_pdu.subarray(1, 7);
+  let enc_network_data = network_pdu.subarray(7);
+
+  // -----------------------------------------------------
+  // 2. Deobfuscate network PDU - ref 3.8.7.3
+  // -----------------------------------------------------
+  // Privacy Random = (EncDST || EncTransportPDU || NetMIC)[0–7]
+  pecb_input.set(enc_network_data.subarray(0, 7), 9);
+  let pecb = crypto.eBytes(pecb_input, subnet.privacy_key);
+
+  // DeobfuscatedData = ObfuscatedData ⊕ PECB[0–5]
+  for (let i = 0; i < 6; i++) {
+    network_nonce[i + 1] = obfuscated_ctl_ttl_seq_src[i] ^ pecb[i];
+  }
+
+  // -----------------------------------------------------
+  // 3. Decrypt and verify network PDU - ref 3.8.5.1
+  // -----------------------------------------------------
+  // network nonce = 0x00 || CTL TTL SEQ SRC || 0x0000 || IV index, set up above
+  result.ctl = (network_nonce[1] & 0x80) >> 7;
+  result.ttl = network_nonce[1] & 0x7F;
+  // proxy nonce = 0x03 || 0x00 || SEQ SRC || 0x0000 || IV index - ref 3.8.5.4
+  if (result.msgtype == 2) {
+    if (result.ctl != 1) {
+      drop(result, "malformed", "Proxy configuration message with CTL = 0");
+      return null;
+    }
+    network_nonce[0] = 0x03;
+    network_nonce[1] = 0x00;
+  } else {
+    network_nonce[0] = 0x00;
+  }
+  result.seq = (network_nonce[2] << 16) | (network_nonce[3] << 8) | network_nonce[4];
+  // NB: SEQ should be unique for each PDU received. We don't enforce this rule here to allow for testing with the same values repeatedly.
+  result.src = (network_nonce[5] << 8) | network_nonce[6];
+
+  // validate SRC
+  if (result.src < 1 || result.src > 32767) {
+    drop(result, "malformed", "SRC is not a valid unicast address. 0x0001-0x7FFF allowed. Ref 3.4.2.2");
+    return null;
+  }
+
+  // NetMIC is 64 bits for control messages
+  let netmic_len = result.ctl == 1 ? 8 : 4;
+  result.netmic = network_pdu.subarray(network_pdu.length - netmic_len);
+  let net_result = crypto.decryptAndVerifyBytes(subnet.encryption_key, enc_network_data, network_nonce, netmic_len);
+  if (net_result.status == -1) {
+    drop(result, "mic", "ERROR: " + net_result.error.message);
+    return null;
+  }
+
+  let decrypted = net_result.decrypted;
+  result.dst = (decrypted[0] << 8) | decrypted[1];
+  let lower_transport_pdu = decrypted.subarray(2);
+  if (lower_transport_pdu.length < 1) {
+    drop(result, "malformed", "Lower transport PDU is empty");
+    return null;
+  }
+  return lower_transport_pdu;
+}
+
+// access payload: 3.7.3
+function decryptAccess(result, enc_access_payload_transmic, seq_auth, transmic_len) {
+  // derive Application Nonce (3.8.5.2)
+  app_nonce[0] = 0x01;
+  app_nonce[1] = result.szmic == 0 ? 0x00 : 0x80;
+  app_nonce[2] = (seq_auth >> 16) & 0xFF;
+  app_nonce[3] = (seq_auth >> 8) & 0xFF;
+  app_nonce[4] = seq_auth & 0xFF;
+  app_nonce[5] = (result.src >> 8) & 0xFF;
+  app_nonce[6] = result.src & 0xFF;
+  app_nonce[7] = (result.dst >> 8) & 0xFF;
+  app_nonce[8] = result.dst & 0xFF;
+
+  // the AppKeys of the AID, see decodeLowerTransport()
+  let appkeys = key_table.appkeys(keys, result.aid);
+  let app_result = null;
+  for (let i = 0; i < appkeys.length; i++) {
+    if (i > 0) {
+      stats.key_retries++;
+    }
+    app_result = crypto.decryptAndVerifyBytes(appkeys[i].key, enc_access_payload_transmic, app_nonce, transmic_len);
+    if (app_result.status != -1) {
+      result.appkey_index = appkeys[i].index;
+      break;
+    }
+  }
+  return app_result || { status: -1, decrypted: null, error: new Error("no AppKey with AID " + result.aid) };
+}
+
+// lower and upper transport, once the network PDU has been authenticated. app_result is
+// the decrypted access payload of unsegmented messages if already available, or null
+function decodeLowerTransport(network_pdu, lower_transport_pdu, result, app_result) {
+  let cache_key = networkCacheKey(network_pdu);
+  if (network_cache.has(cache_key)) {
+    // a copy decrypted in the meantime, see submitProxyPdu()
+    return drop(result, "duplicate");
+  }
+  networkCacheAdd(cache_key);
+
+  if (result.msgtype == 2) {
+    // not relayed, so not subject to replay protection
+    result.opcode = lower_transport_pdu[0];
+    result.params = lower_transport_pdu.subarray(1);
+    result.status = DECODE_PROXY_CONFIG;
+    return result;
+  }
+  if (result.ctl == 1) {
+    return decodeControl(result, lower_transport_pdu);
+  }
+
+  // lower transport layer: 3.5.2.1
+  let seg_akf_aid = lower_transport_pdu[0];
+  result.seg = (seg_akf_aid & 0x80) >> 7;
+  result.akf = (seg_akf_aid & 0x40) >> 6;
+  result.aid = seg_akf_aid & 0x3F;
+  // messages encrypted with a device key aren't meant for the bridge
+  if (result.akf == 0 || key_table.appkeys(keys, result.aid).length == 0) {
+    return drop(result, "aid", "ERROR: unknown AID. Discarding message.");
+  }
+
+  let transmic_len;
+  let seq_auth = result.seq;
+  let enc_access_payload_transmic;
+  let seq_zero = 0;
+  let seg_o = 0;
+  let seg_n = 0;
+
+  if (result.seg == 0) {
+    enc_access_payload_transmic = lower_transport_pdu.subarray(1);
+    transmic_len = 4; // 32 bits
+  } else { // 3.5.2.2 Segmented Access message
+    if (lower_transport_pdu.length < 5) {
+      return drop(result, "malformed", "Segmented lower transport PDU is too short");
+    }
+    let hdr = (lower_transport_pdu[1] << 16) | (lower_transport_pdu[2] << 8) | lower_transport_pdu[3];
+
+    result.szmic = (hdr >> 23) & 0x1;
+    seq_zero = (hdr >> 10) & 0x1FFF;
+    seg_o = (hdr & 0x3E0) >> 5; // pick 5 bits
+    seg_n = hdr & 0x1F; // pick last 5 bits
+    transmic_len = result.szmic == 0 ? 4 : 8; // 32 or 64 bits
+
+    // SeqAuth is the SEQ of the first segment, of which SeqZero holds the 13 lsb - ref 3.5.3.1
+    seq_auth = result.seq - ((result.seq - seq_zero) & 0x1FFF);
+    if (seq_auth < 0) {
+      return drop(result, "malformed", "SeqZero doesn't match SEQ");
+    }
+  }
+  result.seq = seq_auth;
+
+  // Check packet duplication against the replay protection list
+  if (replay.isReplay(result.src, iv_index_int, seq_auth)) {
+    return drop(result, "replay");
+  }
+
+  if (result.seg == 1) {
+    enc_access_payload_transmic = reassembly.addSegment(result.src, seq_zero, seg_o, seg_n, lower_transport_pdu.subarray(4));
+    if (enc_access_payload_transmic == null) {
+      result.status = DECODE_INCOMPLETE;
+      return result;
+    }
+  }
+
+  // upper transport: 3.6.2
+  if (enc_access_payload_transmic.length <= transmic_len) {
+    return drop(result, "malformed", "Upper transport PDU is too short");
+  }
+  result.transmic = enc_access_payload_transmic.subarray(enc_access_payload_transmic.length - transmic_len);
+
+  if (app_result == null) {
+    let time = stageStart();
+    app_result = decryptAccess(result, enc_access_payload_transmic, seq_auth, transmic_len);
+    stageEnd("access", time);
+  }
+  if (app_result.status == -1) {
+    return drop(result, "mic", "ERROR: " + app_result.error.message);
+  }
+  if (app_result.appkey_index !== undefined) {
+    result.appkey_index = app_result.appkey_index;
+  }
+  // 3.8.8: the list is only updated once the message has been authenticated
+  replay.update(result.src, iv_index_int, seq_auth);
+
+  if (!getOpcodeAndParams(app_result.decrypted, result)) {
+    return drop(result, "malformed", "Invalid access payload opcode");
+  }
+
+  result.status = DECODE_OK;
+  return result;
+}
+
+module.exports.DECODE_OK = DECODE_OK;
+module.exports.DECODE_INCOMPLETE = DECODE_INCOMPLETE;
+module.exports.DECODE_BEACON = DECODE_BEACON;
+module.exports.DECODE_DROPPED = DECODE_DROPPED;
+module.exports.DECODE_CONTROL = DECODE_CONTROL;
+module.exports.DECODE_PROXY_CONFIG = DECODE_PROXY_CONFIG;
+module.exports.setKeys = setKeys;
+module.exports.setIvIndex = setIvIndex;
+module.exports.decodeProxyPdu = decodeProxyPdu;
+module.exports.submitProxyPdu = submitProxyPdu;
+module.exports.decryptNetworkPdu = decryptNetworkPdu;
+module.exports.setPool = setPool;
+module.exports.setStageObserver = setStageObserver;
+module.exports.reset = reset;
+module.exports.getStats = getStats;
@@ -0,0 +1,83 @@
+//--------------------------------------------------------------
+// Downlink command queue
+// Commands received from ThingsBoard are queued here and the
+// bridge is notified right away, so they are written to the proxy
+// as soon as the GATT link can accept them. Pending commands are
+// coalesced per target: a newer command for the same destination
+// and type replaces the one still waiting.
+//--------------------------------------------------------------
+
+// pending commands by "<type>:<dst>", in arrival order
+let pending = new Map();
+let handler = null;
+
+let stats = {
+  enqueued: 0,
+  coalesced: 0,
+  sent: 0,
+  failed: 0,
+  latency_total: 0,
+  latency_max: 0
+};
+
+// fn is called whenever a command is queued
+function setHandler(fn) {
+  handler = fn;
+}
+
+// command: {type, dst, ...type specific fields}
+function push(command) {
+  let key = command.type + ':' + command.dst;
+  command.enqueued_at = Date.now();
+
+  if (pending.has(key)) {
+    // keep the queue position of the replaced command
+    stats.coalesced++;
+  }
+  pending.set(key, command);
+  stats.enqueued++;
+
+  if (handler != null) {
+    handler();
+  }
+}
+
+// oldest pending command, null if none
+function shift() {
+  if (pending.size == 0) {
+    return null;
+  }
+  let key = pending.keys().next().value;
+  let command = pending.get(key);
+  pending.delete(key);
+  return command;
+}
+
+// to be called once a command has been written to the proxy
+function sent(command) {
+  let latency = Date.now() - command.enqueued_at;
+  stats.sent++;
+  stats.latency_total += latency;
+  stats.latency_max = Math.max(stats.latency_max, latency);
+}
+
+// to be called when a command couldn't be written to the proxy
+function failed(command) {
+  stats.failed++;
+}
+
+function depth() {
+  return pending.size;
+}
+
+function getStats() {
+  return stats;
+}
+
+module.exports.setHandler = setHandler;
+module.exports.push = push;
+module.exports.shift = shift;
+module.exports.sent = sent;
+module.exports.failed = failed;
+module.exports.depth = depth;
+module.exports.getStats = getStats;
@@ -0,0 +1,84 @@
+//--------------------------------------------------------------
+// Key table
+// NetKeys and AppKeys known to the bridge, with the material
+// derived from them (k2, k4) computed once, indexed by NID and
+// by AID. NID is 7 bits and AID 6 bits, so different keys may
+// share one: the keys of a NID or AID are tried in turn, at most
+// MAX_CANDIDATES of them, so that a PDU costs a bounded number
+// of AES operations whatever the size of the table.
+//--------------------------------------------------------------
+const crypto = require('./crypto.js');
+
+const MAX_CANDIDATES = 4;
+
+const NONE = [];
+
+function index(map, id, entry) {
+  if (!map.has(id)) {
+    map.set(id, []);
+  }
+  let entries = map.get(id);
+  if (entries.length >= MAX_CANDIDATES) {
+    console.log(`Warning: more than ${MAX_CANDIDATES} keys with ID ${id.toString(16)}, key ${entry.index} is ignored`);
+    return;
+  }
+  entries.push(entry);
+}
+
+// keys are hex strings, as stored in config.js; the index of a key is its position in the list
+function create(hex_netkeys, hex_appkeys) {
+  let table = {
+    subnets: new Map(),
+    appkeys: new Map(),
+    netkey_count: 0,
+    appkey_count: 0
+  };
+
+  let seen = new Set();
+  hex_netkeys.forEach((hex_netkey, i) => {
+    if (seen.has(hex_netkey.toLowerCase())) {
+      return;
+    }
+    seen.add(hex_netkey.toLowerCase());
+    let k2_material = crypto.k2(hex_netkey, "00");
+    let nid = parseInt(k2_material.NID, 16);
+    index(table.subnets, nid, {
+      index: i,
+      nid: nid,
+      encryption_key: crypto.createKey(Buffer.from(k2_material.encryption_key, 'hex')),
+      privacy_key: crypto.createKey(Buffer.from(k2_material.privacy_key, 'hex'))
+    });
+    table.netkey_count++;
+  });
+
+  seen.clear();
+  hex_appkeys.forEach((hex_appkey, i) => {
+    if (seen.has(hex_appkey.toLowerCase())) {
+      return;
+    }
+    seen.add(hex_appkey.toLowerCase());
+    let aid = parseInt(crypto.k4(hex_appkey), 16);
+    index(table.appkeys, aid, {
+      index: i,
+      aid: aid,
+      key: crypto.createKey(Buffer.from(hex_appkey, 'hex'))
+    });
+    table.appkey_count++;
+  });
+  return table;
+}
+
+// subnets whose NID is nid, empty if none
+function subnets(table, nid) {
+  return table.subnets.get(nid) || NONE;
+}
+
+// application keys whose AID is aid, empty if none
+function appkeys(table, aid) {
+  return table.appkeys.get(aid) || NONE;
+}
+
+module.exports.MAX_CANDIDATES = MAX_CANDIDATES;
+module.exports.create = create;
+module.exports.subnets = subnets;
+module.exports.appkeys = appkeys;
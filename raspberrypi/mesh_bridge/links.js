@@ -0,0 +1,253 @@
+//--------------------------------------------------------------
+// Proxy GATT links
+// The bridge keeps a connection to several proxy nodes at once.
+// Each link has its own proxy SAR state and its own queue of
+// proxy PDUs to write. Network PDUs received on any link go
+// through the same decoder, whose network message cache and
+// replay protection list drop the copies relayed by the other
+// proxies. Downlink network PDUs are written on the link with
+// the lowest expected delay: queue depth times write latency.
+// Proxy PDUs are split in SAR segments only when they don't fit
+// the ATT MTU negotiated on the link.
+//--------------------------------------------------------------
+const reassembly = require('./reassembly.js');
+const proxy_filter = require('./proxy_filter.js');
+
+// write latency estimate of a new link, ms
+const INITIAL_WRITE_LATENCY = 20;
+// a failed write counts as a write this slow, ms
+const WRITE_ERROR_PENALTY = 1000;
+// links a network PDU is tried on before its write fails
+const MAX_WRITE_ATTEMPTS = 3;
+// weight of the latest write in the latency estimate
+const LATENCY_WEIGHT = 0.2;
+// ATT MTU until a larger one is negotiated - ref Core 3.F.3.2.8
+const DEFAULT_ATT_MTU = 23;
+// ATT write and notification header: opcode and handle
+const ATT_HEADER_SIZE = 3;
+
+// links by peripheral id, connecting ones included
+let links = new Map();
+
+function create(id, peripheral) {
+  let link = {
+    id: id,
+    peripheral: peripheral,
+    char_in: null,
+    char_out: null,
+    sar: reassembly.createProxyReassembly(),
+    filter: proxy_filter.createFilter(),
+    // a link can be written once the IV index is received from a Mesh Beacon on it
+    ready: false,
+    closed: false,
+    // ATT MTU negotiated on the connection, see watchMtu()
+    att_mtu: 0,
+    // pending writes: {network_pdu, msgtype, callback, pinned, attempts}, the head one is being written while writing is true
+    queue: [],
+    writing: false,
+    write_latency: INITIAL_WRITE_LATENCY,
+    // notifications and complete proxy PDUs received, to measure proxy SAR overhead
+    notifications: 0,
+    proxy_pdus: 0,
+    // notifications dropped while the crypto workers are saturated
+    notifications_dropped: 0,
+    writes: 0,
+    segments_written: 0,
+    write_errors: 0
+  };
+  links.set(id, link);
+  return link;
+}
+
+function has(id) {
+  return links.has(id);
+}
+
+function count() {
+  return links.size;
+}
+
+function readyCount() {
+  let ready = 0;
+  for (let link of links.values()) {
+    if (link.ready) {
+      ready++;
+    }
+  }
+  return ready;
+}
+
+// ready link with the lowest expected delay, other than exclude, null if none
+function select(exclude) {
+  let best = null;
+  let best_score = Infinity;
+  for (let link of links.values()) {
+    if (!link.ready || link == exclude) {
+      continue;
+    }
+    let score = (link.queue.length + 1) * link.write_latency;
+    if (score < best_score) {
+      best = link;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+// ATT MTU of the link, as negotiated by noble on connection
+function mtu(link) {
+  return link.att_mtu || (link.peripheral && link.peripheral.mtu) || DEFAULT_ATT_MTU;
+}
+
+// noble 1.9.1 exchanges the ATT MTU on connection but doesn't report it: its HCI
+// bindings get it from the GATT layer through onMtu(address, mtu) and drop it. Record
+// it on the link of the peripheral, whose id is the address without colons. Forks
+// that set peripheral.mtu keep working through the original handler
+function watchMtu(noble) {
+  let bindings = noble._bindings;
+  if (!bindings || typeof bindings.onMtu !== 'function') {
+    return;
+  }
+  let onMtu = bindings.onMtu;
+  bindings.onMtu = function (address, att_mtu) {
+    let link = links.get(String(address).split(':').join('').toLowerCase());
+    if (link) {
+      link.att_mtu = att_mtu;
+    }
+    return onMtu.apply(this, arguments);
+  };
+}
+
+// proxy PDU of the given msgtype carrying pdu, split in SAR segments of at most size bytes - ref 6.3.1
+function proxySegments(pdu, msgtype, size) {
+  if (pdu.length + 1 <= size) {
+    let segment = Buffer.alloc(pdu.length + 1);
+    segment[0] = msgtype;
+    segment.set(pdu, 1);
+    return [segment];
+  }
+
+  let segments = [];
+  let chunk = size - 1;
+  for (let offset = 0; offset < pdu.length; offset += chunk) {
+    let data = pdu.subarray(offset, offset + chunk);
+    let sar = offset == 0 ? 0x40 : (offset + chunk >= pdu.length ? 0xC0 : 0x80);
+    let segment = Buffer.alloc(data.length + 1);
+    segment[0] = sar | msgtype;
+    segment.set(data, 1);
+    segments.push(segment);
+  }
+  return segments;
+}
+
+// queue a network PDU (Buffer) on the best link; callback(error) once it has been written,
+// or once it couldn't be written on MAX_WRITE_ATTEMPTS links
+function write(network_pdu, msgtype, callback) {
+  requeue({ network_pdu: network_pdu, msgtype: msgtype, callback: callback, pinned: false, attempts: 0 }, null);
+}
+
+// queue the entry on the best link other than exclude
+function requeue(entry, exclude) {
+  let link = select(exclude);
+  if (link == null) {
+    entry.callback(new Error("no proxy link available"));
+    return;
+  }
+  link.queue.push(entry);
+  pump(link);
+}
+
+// queue a PDU on the given link, e.g. proxy configuration messages. It is dropped if the link is lost
+function writeTo(link, network_pdu, msgtype, callback) {
+  link.queue.push({ network_pdu: network_pdu, msgtype: msgtype, callback: callback, pinned: true, attempts: 0 });
+  pump(link);
+}
+
+function pump(link) {
+  if (link.writing || link.closed || link.queue.length == 0) {
+    return;
+  }
+  link.writing = true;
+  let entry = link.queue[0];
+  entry.attempts++;
+  entry.segments = proxySegments(entry.network_pdu, entry.msgtype, mtu(link) - ATT_HEADER_SIZE);
+  writeSegment(link, entry, 0, Date.now());
+}
+
+// segments of a network PDU are written in order on the same link, as required by proxy SAR
+function writeSegment(link, entry, index, started) {
+  link.char_in.write(entry.segments[index], true, error => {
+    if (link.closed) {
+      // pending writes have been moved to another link
+      return;
+    }
+    link.segments_written++;
+    if (error) {
+      link.write_errors++;
+      console.log(`Error sending to mesh_proxy_data_in of "${link.id}"`);
+    } else if (index + 1 < entry.segments.length) {
+      writeSegment(link, entry, index + 1, started);
+      return;
+    }
+
+    let latency = error ? WRITE_ERROR_PENALTY : Date.now() - started;
+    link.write_latency += LATENCY_WEIGHT * (latency - link.write_latency);
+    link.writes++;
+    link.queue.shift();
+    link.writing = false;
+    if (!error) {
+      entry.callback(null);
+    } else if (entry.pinned || entry.attempts >= MAX_WRITE_ATTEMPTS) {
+      entry.callback(error);
+    } else {
+      // the whole PDU is written again, proxy SAR segments can't continue on another link
+      requeue(entry, link);
+    }
+    pump(link);
+  });
+}
+
+// the link is gone: its pending writes, the one in progress included, go to the remaining links
+// unless they are meant for this link only
+function close(link) {
+  if (link.closed) {
+    return;
+  }
+  link.closed = true;
+  link.ready = false;
+  links.delete(link.id);
+
+  let pending = link.queue;
+  link.queue = [];
+  for (let entry of pending) {
+    if (entry.pinned) {
+      entry.callback(new Error("proxy link lost"));
+    } else {
+      requeue(entry, null);
+    }
+  }
+}
+
+// a notification has been received on the link, complete is true if it ended a proxy PDU
+function received(link, complete) {
+  link.notifications++;
+  if (complete) {
+    link.proxy_pdus++;
+  }
+}
+
+function all() {
+  return links.values();
+}
+
+module.exports.create = create;
+module.exports.has = has;
+module.exports.count = count;
+module.exports.readyCount = readyCount;
+module.exports.write = write;
+module.exports.writeTo = writeTo;
+module.exports.close = close;
+module.exports.received = received;
+module.exports.mtu = mtu;
+module.exports.watchMtu = watchMtu;
+module.exports.all = all;
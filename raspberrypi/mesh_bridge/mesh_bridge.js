@@ -4,6 +4,19 @@ const fs = require('fs');
 const crypto = require('./crypto.js');
 const mqtt = require('./mqtt.js');
 const utils = require('./utils.js');
+const decoder = require('./decoder.js');
+const replay = require('./replay.js');
+const reassembly = require('./reassembly.js');
+const downlink = require('./downlink.js');
+const sequence = require('./sequence.js');
+const segmentation = require('./segmentation.js');
+const links = require('./links.js');
+const proxy_filter = require('./proxy_filter.js');
+const reconnect = require('./reconnect.js');
+const crypto_pool = require('./crypto_pool.js');
+const metrics = require('./metrics.js');
+const sensor_messages = require('./sensor_messages.js');
+const trace = require('./trace.js');
 
 // load configuration file
 let config;
@@ -17,21 +30,53 @@ try {
 const MESH_SERVICE_UUID = '1828';
 const MESH_CHARACTERISTIC_IN_UUID = '2add';
 const MESH_CHARACTERISTIC_OUT_UUID = '2ade';
-let meshCharacteristicIn = "";
-let meshCharacteristicOut = "";
 
-// proxy client is connected once it receives the IV index from a Mesh Beacon messagge
-let isConnected = false;
-let sequence_number = 0;
-let send_interval;
+// decoder, reassembly and downlink counters are logged with this period
+const STATS_LOG_INTERVAL = 60000;
+// the replay protection list is saved with this period, if persistence is enabled
+const RPL_SAVE_INTERVAL = 10000;
+// sequence numbers are reserved on disk this many at a time
+const SEQ_FILE = 'seq';
+const SEQ_BLOCK_SIZE = 1000;
+// TTL of the messages sent by the bridge
+const DEFAULT_TTL = 2;
+// lower transport control opcode - ref 3.6.5.11
+const OPCODE_SEGMENT_ACK = 0x00;
+// proxy PDU message types - ref 6.3.1
+const MSGTYPE_NETWORK_PDU = 0x00;
+const MSGTYPE_PROXY_CONFIGURATION = 0x02;
+
+// a connection attempt is cancelled after this time, ms
+const CONNECT_TIMEOUT = 5000;
+
+// Prometheus metrics, see setup_metrics(); histogram buckets in seconds
+const DECODE_BUCKETS = [0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.01];
+const PUBLISH_BUCKETS = [0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10];
+// proxy SAR field values - ref 6.3.1
+const SAR_TYPES = ['complete', 'first', 'continuation', 'last'];
+const proxy_pdu_metric = metrics.counter('proxy_pdus_total', 'Proxy PDU notifications received, by SAR type');
+const drop_metric = metrics.counter('drops_total', 'Notifications and PDUs dropped, by reason');
+const decode_metric = metrics.histogram('decode_seconds', 'Time spent in each decoding stage: unwrap (proxy SAR and ' +
+  'checks before decryption), network (deobfuscation and decryption), pool (crypto workers, queueing included), ' +
+  'transport (lower and upper transport, access included), access (application decryption), total', DECODE_BUCKETS);
+const publish_metric = metrics.histogram('mqtt_publish_seconds', 'Time from telemetry publish to PUBACK', PUBLISH_BUCKETS);
+
+// number of proxy nodes the bridge stays connected to
+const proxy_links = Math.min(config.proxy_links || config.proxy_ids.length, config.proxy_ids.length);
+
+// PDU trace writer while capturing notifications to config.capture_file, see trace.js
+let capture = null;
+// the capture is written to disk with this period
+const CAPTURE_FLUSH_INTERVAL = 1000;
+
+// true while the crypto worker pool is saturated: notifications are dropped as they arrive
+let gatt_paused = false;
+
+// true while the segments of a downlink command are being written
+let downlink_busy = false;
 
-let onoff_last_value = 0;
 let onoff_id = 0;
 
-let segmentation_buffer = null;
-let pdu_segmentation_buffer = [];
-let latest_window = Array(0x400).fill(-1); // Window for 1024 elements
-
 //------------------------------------------
 // Mesh Network Encryption Key Generation
 //------------------------------------------
@@ -42,6 +87,13 @@ let hex_netkey = config.hex_netkey;
 let hex_appkey = config.hex_appkey;
 let hex_rpi_addr = config.hex_rpi_addr;
 let hex_LED_alert_target = config.hex_LED_alert_target;
+// keys of the subnets and applications the bridge decodes: the ones above, used for
+// sending, come first
+let hex_netkeys = [hex_netkey].concat(config.hex_extra_netkeys || []);
+let hex_appkeys = [hex_appkey].concat(config.hex_extra_appkeys || []);
+// true once the IV index is known from a Mesh Beacon, in this run or a previous one:
+// links are then usable as soon as they are subscribed
+let iv_index_known = false;
 
 hex_encryption_key = ""; // derived from NetKey using k2
 hex_privacy_key = "";    // derived from NetKey using k2
@@ -52,7 +104,7 @@ hex_network_id = "";     // derived from NetKey using k3
 initialise();
 
 function initialise() {
-  crypto.init();
+  crypto.init(config.crypto_backend);
   k2_material = crypto.k2(hex_netkey, "00");
   hex_encryption_key = k2_material.encryption_key;
   hex_privacy_key = k2_material.privacy_key;
@@ -60,23 +112,53 @@ function initialise() {
   hex_aid = crypto.k4(hex_appkey);
   console.log('Network ID: ' + hex_nid);
   network_id = crypto.k3(hex_netkey);
+  restore_iv_index();
+  decoder.setKeys(hex_netkeys, hex_appkeys);
+  if (hex_netkeys.length > 1 || hex_appkeys.length > 1) {
+    console.log(`Decoding ${hex_netkeys.length} subnets and ${hex_appkeys.length} application keys`);
+  }
+  decoder.setIvIndex(hex_iv_index);
+  // decrypt in worker threads, leaving the event loop to GATT and MQTT
+  if (config.crypto_workers > 0) {
+    crypto_pool.init(config.crypto_workers, {
+      crypto_backend: config.crypto_backend,
+      keys: [hex_netkeys, hex_appkeys],
+      iv_index: hex_iv_index
+    });
+    crypto_pool.setPressureHandler(on_crypto_pressure);
+    decoder.setPool(crypto_pool);
+    console.log(`Crypto workers: ${config.crypto_workers}`);
+  }
+  setInterval(log_stats, STATS_LOG_INTERVAL);
+  setup_metrics();
+
+  // record the raw notifications, to be fed back with trace_replay.js
+  if (config.capture_file) {
+    capture = trace.createWriter(config.capture_file);
+    setInterval(() => trace.flush(capture), CAPTURE_FLUSH_INTERVAL);
+    process.on('exit', () => trace.close(capture));
+    console.log("Capturing notifications to " + config.capture_file);
+  }
+  downlink.setHandler(send_to_proxy);
 
-  // restore sequence number
-  fs.readFile('seq', 'utf8', function(err, data){ 
-    if (!data) {
-        console.log('Creating seq file...');
-        fs.writeFile('seq', sequence_number.toString(), (err) => { 
-            if (err) throw err; 
-        });
-    } else {
-      sequence_number = parseInt(data);
-    }
-  });
+  // restore the replay protection list, so that old messages aren't forwarded again after a restart
+  if (config.rpl_file) {
+    replay.enablePersistence(config.rpl_file, RPL_SAVE_INTERVAL);
+  }
+
+  // restore sequence number, skipping what is left of the block reserved by the last run
+  sequence.init(SEQ_FILE, SEQ_BLOCK_SIZE);
 }
 
+// run exit handlers (e.g. state persistence) on Ctrl+C and service stop
+process.on('SIGINT', () => process.exit(0));
+process.on('SIGTERM', () => process.exit(0));
+
 //------------------------------
 // GAP proxy node discovery
 //------------------------------
+links.watchMtu(noble);
+
 noble.on('stateChange', state => {
   if (state === 'poweredOn') {
     console.log('Scanning...');
@@ -92,16 +174,81 @@ noble.on('discover', peripheral => {
     console.log(`Found device: "${peripheral.id}" - not whitelisted, skipping`);
     return;
   }
+  if (links.has(peripheral.id) || reconnect.isPending(peripheral.id) || connecting.has(peripheral.id) ||
+      wanted_links() == 0) {
+    // already connected or being reconnected, or enough proxies
+    return;
+  }
 
-  // connect to the first whitelisted peripheral that is scanned
+  // scanning is resumed once the link is set up, if more proxies are wanted
   noble.stopScanning();
-  console.log(`Connecting to device "${peripheral.id}"`);
+  console.log(`Connecting to device "${peripheral.id}" (${links.count() + 1}/${proxy_links})`);
   connectAndSetUp(peripheral);
 });
 
+// proxies still to look for, those being reconnected excluded
+function wanted_links() {
+  return proxy_links - links.count() - reconnect.pendingCount();
+}
+
+function resume_scanning() {
+  if (wanted_links() > 0) {
+    noble.startScanning([MESH_SERVICE_UUID]);
+  }
+}
+
+// connect again to a known proxy without scanning for it, see reconnect.js
+function schedule_reconnect(peripheral) {
+  let delay = reconnect.nextDelay(peripheral.id);
+  if (delay < 0) {
+    console.log(`Can't reconnect to "${peripheral.id}". Restarting scan...`);
+    resume_scanning();
+    return;
+  }
+  console.log(`Reconnecting to "${peripheral.id}" in ${delay} ms...`);
+  setTimeout(() => connectAndSetUp(peripheral), delay);
+}
+
+// peripheral ids with a connect() in progress. noble can't cancel it, and the callbacks of
+// two connect() calls would both fire once connected: there's one at a time per peripheral
+let connecting = new Set();
+
 function connectAndSetUp(peripheral) {
+  if (connecting.has(peripheral.id)) {
+    // a timed out attempt is still connecting, it retries once noble is done with it
+    return;
+  }
+  // the callbacks of an attempt do nothing once it is no longer active
+  let attempt = { link: links.create(peripheral.id, peripheral), active: true };
+
+  // noble waits for the peripheral to advertise, give up after a while
+  let connect_timer = setTimeout(() => {
+    console.log(`Timeout connecting to "${peripheral.id}"`);
+    attempt.active = false;
+    links.close(attempt.link);
+    if (!reconnect.isPending(peripheral.id)) {
+      resume_scanning();
+    }
+  }, CONNECT_TIMEOUT);
 
+  connecting.add(peripheral.id);
   peripheral.connect(error => {
+    connecting.delete(peripheral.id);
+    clearTimeout(connect_timer);
+    if (!attempt.active) {
+      // timed out already: drop the late connection, the disconnect callback retries
+      if (error) {
+        connect_failed(attempt, false);
+      } else {
+        peripheral.disconnect();
+      }
+      return;
+    }
+    if (error) {
+      console.log(`Error connecting to "${peripheral.id}"`);
+      connect_failed(attempt, false);
+      return;
+    }
     console.log(`Connected to "${peripheral.id}"`);
 
     // specify the services and characteristics to discover
@@ -111,383 +258,386 @@ function connectAndSetUp(peripheral) {
     peripheral.discoverSomeServicesAndCharacteristics(
         serviceUUIDs,
         characteristicUUIDs,
-        onServicesAndCharacteristicsDiscovered
+        (error, services, characteristics) => onServicesAndCharacteristicsDiscovered(attempt, error, services, characteristics)
     );
   });
 
-  peripheral.on('disconnect', () => {
-    console.log('Disconnected. Restarting scan...');
-    isConnected = false;
-    clearInterval(send_interval);
-    noble.startScanning([MESH_SERVICE_UUID]);}
-  );
+  peripheral.once('disconnect', () => {
+    if (!attempt.active) {
+      // the attempt has failed once connected, try again now that noble is disconnected
+      connect_failed(attempt, false);
+      return;
+    }
+    console.log(`Disconnected from "${peripheral.id}"`);
+    attempt.active = false;
+    // pending downlink writes are moved to the remaining links
+    links.close(attempt.link);
+    schedule_reconnect(peripheral);
+  });
+}
+
+// the connection attempt failed, or the link couldn't be set up once connected: the peripheral
+// is reconnected or scanning goes on. A connected peripheral is disconnected first, and the
+// next attempt waits for the disconnection
+function connect_failed(attempt, connected) {
+  let peripheral = attempt.link.peripheral;
+  attempt.active = false;
+  links.close(attempt.link);
+  if (connected) {
+    peripheral.disconnect();
+    return;
+  }
+  peripheral.removeAllListeners('disconnect');
+  if (reconnect.isPending(peripheral.id)) {
+    schedule_reconnect(peripheral);
+  } else {
+    resume_scanning();
+  }
 }
 
 //---------------------------------
 // GATT notifications management
 //---------------------------------
-function onServicesAndCharacteristicsDiscovered(error, services, characteristics) {
-
+function onServicesAndCharacteristicsDiscovered(attempt, error, services, characteristics) {
+  if (!attempt.active) {
+    return;
+  }
+  let link = attempt.link;
+  if (error) {
+    console.log(`Error discovering the mesh proxy service of "${link.id}"`);
+    connect_failed(attempt, true);
+    return;
+  }
 
-  console.log('Discovered services and characteristics');
+  console.log(`Discovered services and characteristics of "${link.id}"`);
   // console.log('Services: ' + services);
   characteristics.forEach(function(characteristic) {
     if (characteristic.uuid == MESH_CHARACTERISTIC_IN_UUID) {
-      meshCharacteristicIn = characteristic;
-      // console.log('Characteristics mesh_proxy_data_in: ' + meshCharacteristicIn);
+      link.char_in = characteristic;
     }
     if (characteristic.uuid == MESH_CHARACTERISTIC_OUT_UUID) {
-      meshCharacteristicOut = characteristic;
-      // console.log('Characteristics mesh_proxy_data_out: ' + meshCharacteristicOut);
+      link.char_out = characteristic;
     }
   })
-  
-  // data callback receives notifications
-  meshCharacteristicOut.on('data', (data, isNotification) => {
+  if (!link.char_in || !link.char_out) {
+    console.log(`"${link.id}" has no mesh proxy data characteristics`);
+    connect_failed(attempt, true);
+    return;
+  }
+
+  // data callback receives notifications, PDUs from all links go through the same decoder
+  link.char_out.on('data', (data, isNotification) => {
+    if (capture) {
+      trace.write(capture, link.id, data);
+    }
+    if (gatt_paused) {
+      link.notifications_dropped++;
+      drop_metric.inc({reason: "backpressure"});
+      return;
+    }
     var octets = Uint8Array.from(data);
     //console.log('Received: "' + utils.u8AToHexString(octets).toUpperCase() + '"');
-    logAndValidatePdu(octets);
+    logAndValidatePdu(octets, Date.now(), link);
   });
 
   // subscribe to be notified whenever the peripheral update the characteristic
-  meshCharacteristicOut.subscribe(error => {
+  link.char_out.subscribe(error => {
+    if (!attempt.active) {
+      return;
+    }
     if (error) {
       console.error('Error subscribing to mesh_proxy_data_out');
+      connect_failed(attempt, true);
     } else {
       console.log('Subscribed for mesh_proxy_data_out notifications');
+      // with a known IV index there's no need to wait for a Mesh Beacon
+      if (iv_index_known) {
+        set_link_ready(link);
+      }
     }
   });
 
-  send_interval = setInterval(send_to_proxy, 500);
+  resume_scanning();
 }
 
 
-// periodically check new messages from MQTT and send them to the mesh network
-function send_to_proxy(){
-  if (!isConnected) {
-    console.log('ERROR: IV index has not been configured by Mesh Beacon yet!');
+// send queued downlink commands to the mesh network, one at a time. Called when a
+// command is queued, when a write completes and when the proxy connection is ready
+function send_to_proxy() {
+  if (downlink_busy || downlink.depth() == 0) {
     return;
   }
-
-  if(mqtt.check_new_onoff() == onoff_last_value) {
-    // no new messages from MQTT has been received
+  if (links.readyCount() == 0) {
+    console.log(`Downlink: ${downlink.depth()} commands queued, waiting for the IV index from a Mesh Beacon`);
     return;
   }
 
+  let command = downlink.shift();
+
   // configure access payload parameters
-  let destination = hex_LED_alert_target;
-  let onoff_value = utils.toHex(mqtt.check_new_onoff(),1);
+  let destination = command.dst;
+  let onoff_value = utils.toHex(command.onoff,1);
   let opcode = '8203';
   let params = `${utils.toHex(onoff_value,1)}${utils.toHex(onoff_id,2)}`;
-  onoff_last_value = mqtt.check_new_onoff();
   onoff_id++;
-  
+
   console.log(colors.green.bold(`Sending on/off alert to mesh: ${(onoff_value == 1) ? "ON" : "OFF"}`));
-  let segments = build_message(opcode, params, destination);
-  segments.forEach(function(segment) {
-    // console.log(`Sending segment: ${segment}`);
-    let octets = utils.hexToU8A(segment)
-    let data = Buffer.from(octets);
-    meshCharacteristicIn.write(data, true, error => {
-      if (error) {
-        console.log('Error sending to mesh_proxy_data_in');
-      }
-    }); 
-  });
-} 
+  let tx = build_message(opcode, params, destination);
+  if (!tx) {
+    send_to_proxy();
+    return;
+  }
+
+  downlink_busy = true;
+  if (tx.seg == 0) {
+    write_pdu(tx, 0, error => command_done(command, error));
+  } else {
+    // segments are acknowledged by unicast destinations, see segmentation.js
+    segmentation.start(tx, write_pdu, error => command_done(command, error));
+  }
+}
+
+// the command has been sent, or has failed: move on to the next queued one
+function command_done(command, error) {
+  downlink_busy = false;
+  if (error) {
+    console.log(colors.red(`Downlink: ${error.message}`));
+    downlink.failed(command);
+  } else {
+    downlink.sent(command);
+  }
+  send_to_proxy();
+}
 
+// send lower transport PDU tx.pdus[index] in a new network PDU. The first one uses
+// SeqAuth as SEQ, segments and retransmissions take new sequence numbers
+function write_pdu(tx, index, callback) {
+  let seq = tx.seq_auth;
+  if (tx.transmissions > 0) {
+    seq = sequence.allocate(1);
+    // SeqZero must identify SeqAuth - ref 3.5.3.1
+    if (seq < 0 || seq - tx.seq_auth > 0x1FFF) {
+      callback(new Error("no sequence number left for the segmented message"));
+      return;
+    }
+  }
+  tx.transmissions++;
 
+  let network_pdu = build_network_pdu(utils.u8AToHexString(tx.pdus[index]), seq, tx.hex_dst);
+  // network PDUs are spread over the proxy links and split in proxy PDU segments there, see links.js
+  links.write(network_pdu, MSGTYPE_NETWORK_PDU, callback);
+}
 
 //----------------------------------
 // Proxy PDU Decryption function
 //----------------------------------
-function logAndValidatePdu(octets) {
-
-  // length validation
-  if (octets.length < 1) {
-    console.log(colors.red("Error: No data received"));
-    return;
+// received_at is the notification time in ms, used as telemetry timestamp,
+// link the proxy link the notification has been received on
+function logAndValidatePdu(octets, received_at, link) {
+  // first and continuation proxy SAR segments don't complete a proxy PDU
+  let sar = octets.length > 0 ? octets[0] >> 6 : 0;
+  links.received(link, sar == 0 || sar == 3);
+  proxy_pdu_metric.inc({sar: SAR_TYPES[sar]});
+
+  let started = metrics.enabled() ? process.hrtime.bigint() : 0n;
+  if (crypto_pool.size() > 0) {
+    decoder.submitProxyPdu(octets, link.sar, result => handle_decoded(result, received_at, link, started));
+  } else {
+    handle_decoded(decoder.decodeProxyPdu(octets, link.sar), received_at, link, started);
   }
+}
 
-  // -----------------------------------------------------
-  // 1. Extract proxy PDU fields : SAR, msgtype, data
-  // -----------------------------------------------------
-  sar_msgtype = octets.subarray(0, 1);
-  // console.log("sar_msgtype="+sar_msgtype);
+// started is the hrtime of the notification, 0 if not measured
+function handle_decoded(result, received_at, link, started) {
+  if (started && result.status != decoder.DECODE_INCOMPLETE) {
+    decode_metric.observe({stage: "total"}, Number(process.hrtime.bigint() - started) / 1e9);
+  }
 
-  // PDU segmentation
-  sar = (sar_msgtype & 0xC0) >> 6;
-  if (sar < 0 || sar > 3) {
-    // console.log(colors.red("SAR contains invalid value. 0-3 allowed. Ref Table 6.2"));
+  if (result.status == decoder.DECODE_BEACON) {
+    extract_mesh_beacon(result.beacon, link);
     return;
-  } else if (sar == 0) {
-    // console.log("Complete message: " + utils.u8AToHexString(octets));
-  } else if (sar == 1) {
-    segmentation_buffer = null;
-    segmentation_buffer = Buffer.from(octets);
-    // console.log("First segment of message saved");
+  } else if (result.status == decoder.DECODE_CONTROL) {
+    handle_control(result);
     return;
-  } else if (sar == 2) {
-    concatenate(octets.subarray(1, octets.length));
-    // console.log("Continuation of a message saved");
+  } else if (result.status == decoder.DECODE_PROXY_CONFIG) {
+    handle_proxy_config(result, link);
     return;
-  } else if (sar == 3){
-    concatenate(octets.subarray(1, octets.length));
-    // console.log("Last segment of a message saved");
-    octets = Uint8Array.from(segmentation_buffer);
-  }
-
-
-  msgtype = sar_msgtype & 0x3F;
-  if (msgtype < 0 || msgtype > 3) {
-    console.log(colors.red("Message Type contains invalid value. 0x00-0x03 allowed. Ref Table 6.3"));
+  } else if (result.status == decoder.DECODE_DROPPED) {
+    drop_metric.inc({reason: result.reason});
+    if (result.error != "") {
+      console.log(colors.red(result.error));
+    }
     return;
-  } else if (msgtype == 1) {
-    // mesh beacon received
-    extract_mesh_beacon(octets.subarray(1, octets.length));
+  } else if (result.status != decoder.DECODE_OK) {
     return;
   }
 
-  // See table 3.7 for min length of network PDU and 6.1 for proxy PDU length
-  if (octets.length < 15) {
-    console.log(colors.red("PDU is too short (min 15 bytes) - " + octets.length+" bytes received"));
+  let hex_pdu_src = utils.toHex(result.src, 2).toLowerCase();
+  let decoded = sensor_messages.decode_message(hex_pdu_src, result.params, result.opcode, result.company_code);
+  if (decoded.err == "unknown message"){
+    drop_metric.inc({reason: "unknown_message"});
     return;
   }
+  console.log(colors.blue.bold(`New message received from node ${hex_pdu_src}:`));
+  console.log(decoded);
+  mqtt.send_data(decoded, received_at, sensor_messages.get_name(hex_pdu_src));
+}
 
-  network_pdu = null;
-  network_pdu = octets.subarray(1, octets.length);
-
-  // console.log("Proxy PDU: SAR=" + utils.intToHex(sar) + " MSGTYPE=" + utils.intToHex(msgtype) + " NETWORK PDU=" + utils.u8AToHexString(network_pdu));
-
-  // demarshall obfuscated network pdu
-  pdu_ivi = network_pdu.subarray(0, 1) & 0x80;
-  pdu_nid = network_pdu.subarray(0, 1) & 0x7F;
-  obfuscated_ctl_ttl_seq_src = network_pdu.subarray(1, 7);
-  enc_dst = network_pdu.subarray(7, 9);
-  enc_transport_pdu = network_pdu.subarray(9, network_pdu.length - 4);
-  netmic = network_pdu.subarray(network_pdu.length - 4, network_pdu.length);
-
-  hex_pdu_ivi = utils.intToHex(pdu_ivi);
-  hex_pdu_nid = utils.intToHex(pdu_nid);
-  hex_obfuscated_ctl_ttl_seq_src = utils.u8AToHexString(obfuscated_ctl_ttl_seq_src);
-  hex_enc_dst = utils.u8AToHexString(enc_dst);
-  hex_enc_transport_pdu = utils.u8AToHexString(enc_transport_pdu);
-  hex_netmic = utils.intToHex(netmic);
-
-  // console.log("enc_dst=" + hex_enc_dst);
-  // console.log("enc_transport_pdu=" + hex_enc_transport_pdu);
-  // console.log("NetMIC=" + hex_netmic);
-
-  // -----------------------------------------------------
-  // 2. Deobfuscate network PDU - ref 3.8.7.3
-  // -----------------------------------------------------
-  hex_privacy_random = crypto.privacyRandom(hex_enc_dst, hex_enc_transport_pdu, hex_netmic);
-  // console.log("Privacy Random=" + hex_privacy_random);
-
-  deobfuscated = crypto.deobfuscate(hex_obfuscated_ctl_ttl_seq_src, hex_iv_index, hex_netkey, hex_privacy_random, hex_privacy_key);
-  hex_ctl_ttl_seq_src = deobfuscated.ctl_ttl_seq_src;
+// the crypto workers can't keep up: stop taking notifications until their backlog drains
+function on_crypto_pressure(saturated) {
+  gatt_paused = saturated;
+  if (saturated) {
+    console.log(colors.red(`Crypto workers saturated, ${crypto_pool.inFlight()} PDUs in flight: dropping notifications`));
+  } else {
+    console.log(`Crypto workers recovered, ${crypto_pool.inFlight()} PDUs in flight`);
+  }
+}
 
-  // 3.4.6.3 Receiving a Network PDU
-  // Upon receiving a message, the node shall check if the value of the NID field value matches one or more known NIDs
-  if (hex_pdu_nid != hex_nid) {
-    console.log(colors.red("ERROR:unknown NID. Discarding message."));
+// control messages addressed to the bridge
+function handle_control(result) {
+  if (result.opcode != OPCODE_SEGMENT_ACK || result.dst != parseInt(hex_rpi_addr, 16)) {
     return;
   }
-
-  hex_enc_dst = utils.bytesToHex(enc_dst);
-  hex_enc_transport_pdu = utils.bytesToHex(enc_transport_pdu);
-  hex_netmic = utils.bytesToHex(netmic);
-
-
-  // ref 3.8.7.2 Network layer authentication and encryption
-
-  // -----------------------------------------------------
-  // 3. Decrypt and verify network PDU - ref 3.8.5.1
-  // -----------------------------------------------------
-
-  hex_nonce = "00" + hex_ctl_ttl_seq_src + "0000" + hex_iv_index;
-  hex_pdu_ctl_ttl = hex_ctl_ttl_seq_src.substring(0, 2);
-
-  hex_pdu_seq = hex_ctl_ttl_seq_src.substring(2, 8);
-  // NB: SEQ should be unique for each PDU received. We don't enforce this rule here to allow for testing with the same values repeatedly.
-
-  hex_pdu_src = hex_ctl_ttl_seq_src.substring(8, 12);
-  // validate SRC
-  src_int = parseInt(hex_pdu_src,16);
-  if (src_int < 1 || src_int > 32767) {
-    console.log(colors.red("SRC is not a valid unicast address. 0x0001-0x7FFF allowed. Ref 3.4.2.2"));
+  if (result.params.length < 6) {
+    console.log("Error: malformed segment acknowledgment");
     return;
   }
 
-  ctl_int = (parseInt(hex_pdu_ctl_ttl, 16) & 0x80) >> 7;
-  ttl_int = parseInt(hex_pdu_ctl_ttl, 16) & 0x7F;
-
-  // console.log("hex_enc_dst=" + hex_enc_dst);
-  // console.log("hex_enc_transport_pdu=" + hex_enc_transport_pdu);
-  // console.log("hex_netmic=" + hex_netmic);
+  // OBO (1) | SeqZero (13) | RFU (2) | BlockAck (32) - ref 3.5.2.3.1
+  let seq_zero = ((result.params[0] & 0x7F) << 6) | (result.params[1] >> 2);
+  let block_ack = ((result.params[2] << 24) | (result.params[3] << 16) | (result.params[4] << 8) | result.params[5]) >>> 0;
+  segmentation.onAck(result.src, seq_zero, block_ack);
+}
 
-  hex_enc_network_data = hex_enc_dst + hex_enc_transport_pdu + hex_netmic;
-  // console.log("decrypting and verifying network layer: " + hex_enc_network_data + " key: " + hex_encryption_key + " nonce: " + hex_nonce);
-  result = crypto.decryptAndVerify(hex_encryption_key, hex_enc_network_data, hex_nonce, 4);
-  // console.log("result=" + JSON.stringify(result));
-  if (result.status == -1) {
-    console.log(colors.red("ERROR: " + result.error.message));
+// ask the proxy to forward only the traffic the bridge needs - ref 6.6:
+// - accept: messages sent to the bridge and to config.proxy_filter_addresses,
+//   e.g. the sensors publication address
+// - reject: messages sent to the nodes in config.address_map, e.g. LED commands
+function configure_proxy_filter(link) {
+  let type;
+  let hex_addresses;
+  if (config.proxy_filter == "accept") {
+    type = proxy_filter.FILTER_ACCEPT;
+    hex_addresses = [hex_rpi_addr].concat(config.proxy_filter_addresses || []);
+  } else if (config.proxy_filter == "reject") {
+    type = proxy_filter.FILTER_REJECT;
+    hex_addresses = Object.keys(config.address_map);
+  } else {
     return;
   }
 
-  hex_pdu_dst = result.hex_decrypted.substring(0, 4);
-  lower_transport_pdu = result.hex_decrypted.substring(4, result.hex_decrypted.length);
-  // console.log("lower_transport_pdu=" + lower_transport_pdu);
-
-  // lower transport layer: 3.5.2.1
-  hex_pdu_seg_akf_aid = lower_transport_pdu.substring(0, 2);
-  // console.log("hex_pdu_seg_akf_aid=" + hex_pdu_seg_akf_aid);
-  seg_int = (parseInt(hex_pdu_seg_akf_aid, 16) & 0x80) >> 7;
-  akf_int = (parseInt(hex_pdu_seg_akf_aid, 16) & 0x40) >> 6;
-  aid_int = parseInt(hex_pdu_seg_akf_aid, 16) & 0x3F;
-
-  let transmic_len;
-  let aszmic;
-
-  if (seg_int == 0) {
-    pdu_segmentation_buffer = [lower_transport_pdu.substring(2, lower_transport_pdu.length)];
-    aszmic = "00";
-    transmic_len = 8; // 32 bits
-  } else { // 3.5.2.2 Segmented Access message
-    let hdr = parseInt(lower_transport_pdu.substring(2, 8), 16);
-
-    let idx = (hdr & 0x3E0) >> 5; // pick 5 bits
-    let tot = hdr & 0x1F; // pick last 5 bits
-    let szmic = (hdr >> 23) & 0x1;
-    transmic_len = szmic == 0 ? 8 : 16; // 32 or 64 bits
-    aszmic = szmic == 0 ? "00" : "80";
-
-    // console.log("assembling message " + idx + " of " + tot);
-
-    pdu_segmentation_buffer[idx] = lower_transport_pdu.substring(8, lower_transport_pdu.length);
-
-    // Here the magic happens. We assemble the seq_auth according to 3.5.3.1
-    hex_pdu_seq = (
-      (parseInt(hex_pdu_seq.substring(0, 6), 16) & 0xFFE000) + // Upper 11 bits
-      ((hdr >> 10) & 0x1FFF) // Lower 13 bits
-    ).toString(16).padStart(6, "0");
-
-    if (tot !== idx) {
+  let addresses = hex_addresses.map(address => parseInt(address, 16));
+  for (let message of proxy_filter.configure(link.filter, type, addresses)) {
+    let seq = sequence.allocate(1);
+    if (seq < 0) {
       return;
     }
+    let network_pdu = build_network_pdu(utils.u8AToHexString(message), seq, "0000", MSGTYPE_PROXY_CONFIGURATION);
+    links.writeTo(link, network_pdu, MSGTYPE_PROXY_CONFIGURATION, () => {});
   }
+}
 
-  // Check packet duplication
-  let seq = parseInt(hex_pdu_seq, 16);
-  if (
-    latest_window[seq & 0x400] >= seq && // Number in window is in the "past"
-    latest_window[seq & 0x400] - seq < 0x1000 // And not too far in the past (prevent loopback)
-  ) {
-    // console.log("Duplicate packet " + hex_pdu_seq + ", ignoring")
+// Filter Status replies of the proxy
+function handle_proxy_config(result, link) {
+  if (result.opcode != proxy_filter.OPCODE_FILTER_STATUS) {
     return;
   }
+  if (!proxy_filter.onStatus(link.filter, result.params)) {
+    console.log(colors.red(`Proxy filter of "${link.id}" doesn't match: type ${link.filter.status_type}, ` +
+      `${link.filter.status_size} addresses. Configuring it again...`));
+    proxy_filter.reset(link.filter);
+    if (link.filter.mismatches <= 1) {
+      configure_proxy_filter(link);
+    }
+  }
+}
 
-  // Add to window
-  latest_window[seq & 0x400] = seq;
-
-  // upper transport: 3.6.2
-  hex_enc_access_payload_transmic = pdu_segmentation_buffer.join("");
-  pdu_segmentation_buffer = [];
-  // console.log("enc_access_transmic=" + hex_enc_access_payload_transmic);
-
-  hex_enc_access_payload = hex_enc_access_payload_transmic.substring(
-    0,
-    hex_enc_access_payload_transmic.length - transmic_len
-  );
-
-  hex_transmic = hex_enc_access_payload_transmic.substring(
-    hex_enc_access_payload_transmic.length - transmic_len,
-    hex_enc_access_payload_transmic.length
-  );
+// serve the metrics on config.metrics_port, if set; the counters other modules keep
+// are read when the endpoint is scraped
+function setup_metrics() {
+  if (!config.metrics_port) {
+    return;
+  }
+  decoder.setStageObserver((stage, seconds) => decode_metric.observe({stage: stage}, seconds));
+  mqtt.setPublishObserver(seconds => publish_metric.observe(null, seconds));
+
+  metrics.collector('mqtt_connected', 'MQTT broker connection state', 'gauge', () => mqtt.getStats().connected ? 1 : 0);
+  metrics.collector('mqtt_published_total', 'Telemetry publishes acknowledged', 'counter', () => mqtt.getStats().published);
+  metrics.collector('mqtt_publish_errors_total', 'Telemetry publishes failed', 'counter', () => mqtt.getStats().publish_errors);
+  metrics.collector('mqtt_queue_depth', 'Readings waiting for the next telemetry batch', 'gauge', () => mqtt.getStats().batch_depth);
+  metrics.collector('mqtt_outbox_bytes', 'Telemetry stored in the outbox', 'gauge', () => mqtt.getStats().outbox_bytes);
+
+  metrics.collector('gatt_links', 'Proxy links, by state', 'gauge', () =>
+    [[{state: 'connected'}, links.count()], [{state: 'ready'}, links.readyCount()]]);
+  metrics.collector('gatt_reconnects_total', 'Proxy links reconnected after a disconnection', 'counter', () => reconnect.getStats().reconnects);
+  metrics.collector('gatt_reconnect_attempts_total', 'Proxy reconnection attempts', 'counter', () => reconnect.getStats().attempts);
+  metrics.collector('gatt_reconnects_given_up_total', 'Proxy reconnections given up for scanning', 'counter', () => reconnect.getStats().gave_up);
+  metrics.collector('gatt_notifications_total', 'GATT notifications received, by link', 'counter', () =>
+    [...links.all()].map(link => [{link: link.id}, link.notifications]));
+
+  metrics.collector('downlink_queue_depth', 'Downlink commands waiting to be sent', 'gauge', () => downlink.depth());
+  metrics.collector('downlink_commands_total', 'Downlink commands, by outcome', 'counter', () =>
+    [[{result: 'sent'}, downlink.getStats().sent], [{result: 'failed'}, downlink.getStats().failed],
+     [{result: 'coalesced'}, downlink.getStats().coalesced]]);
+  metrics.collector('crypto_pool_in_flight', 'Network PDUs in the crypto workers', 'gauge', () => crypto_pool.inFlight());
+
+  metrics.start(config.metrics_port, config.metrics_host);
+}
 
-  // console.log("enc_access_payload=" + hex_enc_access_payload);
-  // console.log("transmic=" + hex_transmic);
+// log decoder, reassembly and downlink counters, e.g. how many network PDUs have been
+// dropped before any crypto operation
+function log_stats() {
+  let stats = decoder.getStats();
+  let received = stats.cache_hits + stats.cache_misses + stats.nid_rejects + stats.length_rejects;
+  if (received > 0) {
+    let saved = received - stats.cache_misses;
+    console.log(`Decoder: ${received} network PDUs, ${saved} dropped before decryption ` +
+      `(${stats.cache_hits} cache hits, ${stats.nid_rejects} unknown NID, ${stats.length_rejects} bad length), ` +
+      `${stats.cache_misses} cache misses, ${stats.overload_drops} dropped on overload, ${stats.key_retries} key retries`);
+
+    let sar_stats = reassembly.getStats();
+    console.log(`Reassembly: ${sar_stats.completed} segmented messages completed, ${sar_stats.timed_out} timed out, ` +
+      `${sar_stats.evicted} evicted, ${sar_stats.inconsistent} inconsistent segments, ${reassembly.openContexts()} open`);
+  }
 
-  // access payload: 3.7.3
-  // derive Application Nonce (3.8.5.2)
-  hex_app_nonce = "01" + aszmic + hex_pdu_seq + hex_pdu_src + hex_pdu_dst + hex_iv_index;
-  // console.log("application nonce=" + hex_app_nonce);
+  if (crypto_pool.size() > 0) {
+    let pool_stats = crypto_pool.getStats();
+    console.log(`Crypto workers: ${pool_stats.submitted} PDUs in ${pool_stats.batches} batches, ` +
+      `${crypto_pool.inFlight()} in flight (max ${pool_stats.max_in_flight}), ${pool_stats.saturations} saturations, ` +
+      `${pool_stats.refused} refused, ${pool_stats.worker_failures} worker failures`);
+  }
 
-  // console.log("decrypting and verifying access layer: " + hex_enc_access_payload + hex_transmic + " key: " + hex_appkey + " nonce: " + hex_app_nonce);
-  result = crypto.decryptAndVerify(
-    hex_appkey,
-    hex_enc_access_payload + hex_transmic,
-    hex_app_nonce,
-    transmic_len/2
-  );
+  let dl_stats = downlink.getStats();
+  if (dl_stats.enqueued > 0) {
+    let avg_latency = dl_stats.sent > 0 ? Math.round(dl_stats.latency_total / dl_stats.sent) : 0;
+    console.log(`Downlink: ${dl_stats.sent} commands sent, ${dl_stats.failed} failed, ${dl_stats.coalesced} coalesced, ${downlink.depth()} queued, ` +
+      `latency avg ${avg_latency} ms, max ${dl_stats.latency_max} ms`);
+  }
 
-  // console.log("result=" + JSON.stringify(result));
-  if (result.status == -1) {
-    console.log("ERROR: "+result.error.message);
-    return;
+  for (let link of links.all()) {
+    let rx_ratio = link.proxy_pdus > 0 ? (link.notifications / link.proxy_pdus).toFixed(2) : "-";
+    let tx_ratio = link.writes > 0 ? (link.segments_written / link.writes).toFixed(2) : "-";
+    console.log(`Link "${link.id}": ATT MTU ${links.mtu(link)}, ${link.notifications} notifications for ${link.proxy_pdus} proxy PDUs ` +
+      `(${rx_ratio} per PDU), ${link.notifications_dropped} dropped, ${link.writes} writes (${tx_ratio} segments per PDU), ${link.write_errors} write errors, ` +
+      `write latency ${Math.round(link.write_latency)} ms, ${link.queue.length} queued, ` +
+      `${link.filter.statuses} filter status, ${link.filter.status_size} filter addresses`);
   }
 
-  // console.log("access payload=" + result.hex_decrypted);
-
-  hex_opcode_and_params = utils.getOpcodeAndParams(result.hex_decrypted);
-  // console.log("hex_opcode_and_params=" + JSON.stringify(hex_opcode_and_params));
-  hex_opcode = hex_opcode_and_params.opcode;
-  hex_params = hex_opcode_and_params.params;
-  hex_company_code = hex_opcode_and_params.company_code
-
-  /*
-  console.log(" ");
-  console.log("----------");
-  console.log(colors.yellow.bold("Proxy PDU"));
-  console.log(colors.green("  SAR=" + utils.intToHex(sar)));
-  console.log(colors.green("  MESSAGE TYPE=" + utils.intToHex(msgtype)));
-  console.log(colors.yellow.bold("  NETWORK PDU"));
-  console.log(colors.green("    IVI=" + hex_pdu_ivi));
-  console.log(colors.green("    NID=" + hex_pdu_nid));
-  console.log(colors.green("    CTL=" + utils.intToHex(ctl_int)));
-  console.log(colors.green("    TTL=" + utils.intToHex(ttl_int)));
-  console.log(colors.green("    SEQ=" + hex_pdu_seq));
-  console.log(colors.green("    SRC=" + hex_pdu_src));
-  console.log(colors.green("    DST=" + hex_pdu_dst));
-  console.log(colors.yellow.bold("    Lower Transport PDU"));
-  console.log(colors.green("      SEG=" + utils.intToHex(seg_int)));
-  console.log(colors.green("      AKF=" + utils.intToHex(akf_int)));
-  console.log(colors.green("      AID=" + utils.intToHex(aid_int)));
-  console.log(colors.yellow.bold("      Upper Transport PDU"));
-  console.log(colors.yellow.bold("        Access Payload"));
-  console.log(colors.green("          opcode=" + hex_opcode));
-  if (hex_company_code != "") {
-    console.log(colors.green("          company_code=" + hex_company_code));
-  }
-  console.log(colors.green("          params=" + hex_params));
-  console.log(colors.green("        TransMIC=" + hex_transmic));
-  console.log(colors.green("    NetMIC=" + hex_netmic));
-  */
-
-  let decoded = decode_message(hex_pdu_src, hex_params);
-  if (decoded.err == "unknown message"){
-    return;
+  let rc_stats = reconnect.getStats();
+  if (rc_stats.attempts > 0) {
+    console.log(`Reconnects: ${rc_stats.reconnects} completed in ${rc_stats.attempts} attempts, ` +
+      `${rc_stats.gave_up} given up; time to ready ${reconnect.formatHistogram()}`);
   }
-  console.log(colors.blue.bold(`New message received from node ${hex_pdu_src}:`));
-  console.log(decoded);
-  mqtt.send_data(decoded);
-}
 
-// append a Uint8Array to the segmentation buffer
-function concatenate(octets) {
-  if (segmentation_buffer == null){
-    console.log(colors.red("ERROR: proxy PDU concatenation error"));
-    return
-  }
-  var continuation = Buffer.from(octets);
-  var array = [segmentation_buffer,continuation];
-  segmentation_buffer = Buffer.concat(array);
-  // console.log('New Concatenation');
-  return;
+  let seg_stats = segmentation.getStats();
+  if (seg_stats.transfers > 0) {
+    console.log(`Segmentation: ${seg_stats.completed} segmented messages sent, ${seg_stats.failed} failed, ` +
+      `${seg_stats.segments_sent} segments written, ${seg_stats.segments_resent} retransmitted`);
+  }
 }
 
 // extract and validate Mesh Beacon message
-function extract_mesh_beacon(octets) {
+function extract_mesh_beacon(octets, link) {
   // check if beacon type is correct
   var beacon_type = octets.subarray(0,1);
   if (beacon_type != 1){
@@ -502,113 +652,148 @@ function extract_mesh_beacon(octets) {
   // console.log("Network ID from beacon: " + utils.u8AToHexString(octets.subarray(2,10)));
 
   // retrieve IV index
-  hex_iv_index = utils.u8AToHexString(octets.subarray(10,14));
-  // console.log("IV Index: " + hex_iv_index);
-  isConnected = true;
-  return;
-}
-
-function read_short_le(number) {
-  return (
-    parseInt(number.substring(0, 2), 16) +
-    (parseInt(number.substring(2, 4), 16) << 8)
-  );
-}
-
-function decode_message(sender, message) {
-  message = message.toLowerCase();
-  let name = get_name(sender);
-
-  switch (message.substring(0, 4)) {
-    case "102a":
-      return decode_thp(name, message);
-
-    case "132a":
-      return decode_gas(name, message);
-
-    default:
-      // console.log("Error: unknown message");
-      return obj = {err: "unknown message"}
-      //return {}
+  let beacon_iv_index = utils.u8AToHexString(octets.subarray(10,14));
+  if (beacon_iv_index != hex_iv_index || !iv_index_known) {
+    hex_iv_index = beacon_iv_index;
+    decoder.setIvIndex(hex_iv_index);
+    if (crypto_pool.size() > 0) {
+      crypto_pool.setIvIndex(hex_iv_index);
+    }
+    save_iv_index();
   }
+  iv_index_known = true;
+  // console.log("IV Index: " + hex_iv_index);
+  set_link_ready(link);
 }
 
-function get_name(address) {
-  if (address in config.address_map) {
-    return config.address_map[address];
+// the link can be used for downlink messages
+function set_link_ready(link) {
+  if (link.ready || link.closed) {
+    return;
   }
+  console.log(`Proxy link "${link.id}" ready, ${links.readyCount() + 1} of ${proxy_links}`);
+  link.ready = true;
+  reconnect.ready(link.id);
+  configure_proxy_filter(link);
 
-  return address;
+  // send the commands queued while disconnected
+  send_to_proxy();
 }
 
-function decode_thp(name, message) {
-  if (
-    message.substring(0, 4) !== "102a"
-    || message.substring(8, 12) !== "112a"
-    || message.substring(16, 20) !== "122a"
-  ) {
-    console.log("Error: malformed thp message");
-    return {};
+// the IV index received from the last Mesh Beacon is kept in config.iv_index_file, so that
+// links are ready without waiting for a beacon after a restart
+function restore_iv_index() {
+  if (!config.iv_index_file) {
+    return;
   }
-
-  let obj = {};
-  obj['temperature_' + name] = read_short_le(message.substring(4, 8)) / 100;
-  obj['humidity_' + name] = read_short_le(message.substring(12, 16)) / 100;
-  obj['pressure_' + name] = read_short_le(message.substring(20, 24)) / 100;
-
-  return obj;
+  let data;
+  try {
+    data = fs.readFileSync(config.iv_index_file, 'utf8').trim();
+  } catch (err) {
+    return;
+  }
+  if (!/^[0-9a-fA-F]{8}$/.test(data)) {
+    console.log(`Ignoring invalid IV index in ${config.iv_index_file}`);
+    return;
+  }
+  hex_iv_index = data;
+  iv_index_known = true;
+  console.log(`IV index ${hex_iv_index} restored from ${config.iv_index_file}`);
 }
 
-function decode_gas(name, message) {
-  if (message.substring(0, 4) !== "132a") {
-    console.log("Error: malformed gas message");
-    return {};
+function save_iv_index() {
+  if (!config.iv_index_file) {
+    return;
+  }
+  // write and rename, so that a crash never leaves a truncated file behind
+  let tmp_file = config.iv_index_file + '.tmp';
+  try {
+    fs.writeFileSync(tmp_file, hex_iv_index);
+    fs.renameSync(tmp_file, config.iv_index_file);
+  } catch (err) {
+    console.log("Error saving IV index: " + err.message);
   }
-
-  let obj = {};
-  obj['co2_ppm_' + name] = read_short_le(message.substr(4, 8));
-
-  return obj;
 }
 
-// Assemble new mesh message for sending
+// Assemble new mesh message for sending: returns the transfer holding the lower transport
+// PDUs, which are put in network PDUs by build_network_pdu() as they are sent
 function build_message(opcode, params, hex_dst) {
   // console.log("Assembling new mesh message...");
 
   // access PDU content
   let hex_access_payload = `${opcode}${params}`;
+  let access_payload_length = hex_access_payload.length / 2;
   // console.log(`Access Payload: ${hex_access_payload}`);
 
+  let seg_int = segmentation.isSegmented(access_payload_length) ? 1 : 0;
+  let szmic = 0;
+  if (seg_int == 1) {
+    szmic = segmentation.selectSzmic(access_payload_length);
+    if (szmic < 0) {
+      console.log("WARNING: Access payload is too long, 380 bytes at most can be sent.");
+      return;
+    }
+  }
+
+  let seq_auth = sequence.allocate(1);
+  if (seq_auth < 0) {
+    return;
+  }
+
   // upper transport PDU content
-  // !! nonce works only for unsegmented access PDUs !!
-  let hex_pdu_seq = utils.toHex(sequence_number, 3);
-  hex_app_nonce = "0100" + hex_pdu_seq + hex_rpi_addr + hex_dst + hex_iv_index;
-  let utp_enc_result = crypto.meshAuthEncAccessPayload(hex_appkey, hex_app_nonce, hex_access_payload);
+  // application nonce: ASZMIC is set for segmented messages with a 64-bit TransMIC - ref 3.8.5.2
+  let hex_seq_auth = utils.toHex(seq_auth, 3);
+  let hex_aszmic = szmic == 1 ? "80" : "00";
+  hex_app_nonce = "01" + hex_aszmic + hex_seq_auth + hex_rpi_addr + hex_dst + hex_iv_index;
+  let utp_enc_result = crypto.meshAuthEncAccessPayload(hex_appkey, hex_app_nonce, hex_access_payload, szmic == 1 ? 8 : 4);
   let upper_trans_pdu = `${utp_enc_result.EncAccessPayload}${utp_enc_result.TransMIC}`;
   // console.log(`Upper Transport PDU: ${upper_trans_pdu}`);
 
-  // check if upper transport PDU is too long and must be segmented
-  if (upper_trans_pdu.length > 30) {
-      console.log("WARNING: Access payload is too long. Lower Transport Layer segmentation required.")
-      return;
-  }
-
   // lower transport PDU content
-  let seg_int = parseInt(0, 16);
   let akf_int = parseInt(1, 16);
-  let aid_int = parseInt(hex_aid, 16);    
-  let seg_afk_aid = (seg_int << 7) | (akf_int << 6) | aid_int;
-  let lower_transport_pdu = `${utils.intToHex(seg_afk_aid)}${upper_trans_pdu}`;
-  // console.log(`Lower Transport PDU: ${lower_transport_pdu}`);
+  let aid_int = parseInt(hex_aid, 16);
+  let seq_zero = seq_auth & 0x1FFF;
+  let pdus;
+  if (seg_int == 0) {
+    let seg_afk_aid = (seg_int << 7) | (akf_int << 6) | aid_int;
+    pdus = [Buffer.from(utils.hexToU8A(`${utils.intToHex(seg_afk_aid)}${upper_trans_pdu}`))];
+  } else {
+    pdus = segmentation.segment(Buffer.from(utils.hexToU8A(upper_trans_pdu)), akf_int, aid_int, szmic, seq_zero);
+  }
+  // console.log(`Lower Transport PDUs: ${pdus.length}`);
+
+  return {
+    dst: parseInt(hex_dst, 16),
+    hex_dst: hex_dst,
+    seg: seg_int,
+    seq_auth: seq_auth,
+    seq_zero: seq_zero,
+    ttl: DEFAULT_TTL,
+    pdus: pdus,
+    transmissions: 0
+  };
+}
+
+// Encrypt and obfuscate a lower transport PDU into a network PDU (Buffer).
+// Proxy configuration messages (msgtype 2) are control messages with TTL 0, sent with
+// the proxy nonce - ref 6.5
+function build_network_pdu(lower_transport_pdu, seq, hex_dst, msgtype) {
+  msgtype = msgtype || MSGTYPE_NETWORK_PDU;
+  let proxy_config = msgtype == MSGTYPE_PROXY_CONFIGURATION;
+  let hex_pdu_seq = utils.toHex(seq, 3);
 
   // encrypt network PDU
-  let ctl_int = parseInt(0, 16);
-  let ttl_int = parseInt(2, 16);
+  let ctl_int = proxy_config ? 0x80 : 0;
+  let ttl_int = proxy_config ? 0 : DEFAULT_TTL;
   let ctl_ttl = (ctl_int | ttl_int);
   let npdu2 = utils.intToHex(ctl_ttl);
   let norm_enc_key = utils.normaliseHex(hex_encryption_key);
   let hex_net_nonce = "00" + npdu2 + hex_pdu_seq + hex_rpi_addr + "0000" + hex_iv_index;
-  let np_enc_result = crypto.meshAuthEncNetwork(norm_enc_key, hex_net_nonce, hex_dst, lower_transport_pdu);
+  if (proxy_config) {
+    hex_net_nonce = "0300" + hex_pdu_seq + hex_rpi_addr + "0000" + hex_iv_index;
+  }
+  let netmic_size = ctl_int ? 8 : 4;
+  let np_enc_result = crypto.meshAuthEncNetwork(norm_enc_key, hex_net_nonce, hex_dst, lower_transport_pdu, netmic_size);
   let enc_dst = np_enc_result.EncDST;
   let enc_transport_pdu = np_enc_result.EncTransportPDU;
   let netmic = np_enc_result.NetMIC;
@@ -616,7 +801,7 @@ function build_message(opcode, params, hex_dst) {
   
   // obfuscate network header
   let obfuscated = crypto.obfuscate(enc_dst, enc_transport_pdu,
-      netmic, 0, 2, hex_pdu_seq, hex_rpi_addr, hex_iv_index, hex_privacy_key);
+      netmic, utils.intToHex(ctl_int), utils.intToHex(ttl_int), hex_pdu_seq, hex_rpi_addr, hex_iv_index, hex_privacy_key);
   let obfuscated_ctl_ttl_seq_src = obfuscated.obfuscated_ctl_ttl_seq_src;
   // console.log(`Obfuscated network header: ${obfuscated_ctl_ttl_seq_src}`)
 
@@ -628,35 +813,5 @@ function build_message(opcode, params, hex_dst) {
   let network_pdu = npdu1 + obfuscated_ctl_ttl_seq_src + enc_dst + enc_transport_pdu + netmic;
   // console.log(`Network PDU: ${network_pdu}`);
 
-  // proxy PDU header
-  let proxy_pdu = "";
-  let segments = [];
-
-  // console.log(network_pdu.length);
-  if (network_pdu.length > 38) {
-      // console.log(`Proxy PDU is too long. Segmenting...`);
-      segments[0] = proxy_pdu + utils.toHex(64,1) + network_pdu.substring(0,38);
-      // console.log(`First Proxy PDU segment: ${segments[0]}`);
-      segmented_npdu = network_pdu.substring(38);
-      let i = 1;
-      while (segmented_npdu.length > 38) {
-          segments[i] = proxy_pdu + utils.toHex(80,1) + segmented_npdu.substring(0,38);
-          segmented_npdu = segmented_npdu.substring(38);
-          i++;
-          // console.log(`Intermediate Proxy PDU segment: ${segments[i]}`);
-      };
-      segments[i] = proxy_pdu + utils.toHex(192,1) + segmented_npdu;
-      // console.log(`Last Proxy PDU segment: ${segments[i]}`);
-  } else {
-      segments[0] = proxy_pdu + utils.toHex(0,1) + network_pdu;
-      // console.log(`Proxy PDU: ${segments[0]}`);
-  }
-
-  // update sequence number
-  sequence_number++;
-  fs.writeFile('seq', sequence_number.toString(), (err) => { 
-    if (err) throw err; 
-  });
-  
-  return segments;
+  return Buffer.from(utils.hexToU8A(network_pdu));
 }
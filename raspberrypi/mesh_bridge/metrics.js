@@ -0,0 +1,128 @@
+//--------------------------------------------------------------
+// Prometheus metrics
+// Counters and histograms are updated by the bridge as events
+// happen; gauges and the counters other modules already keep are
+// read through collector functions when /metrics is scraped. The
+// endpoint serves the Prometheus text exposition format and binds
+// to localhost unless told otherwise.
+//--------------------------------------------------------------
+const http = require('http');
+
+const PREFIX = 'mesh_bridge_';
+
+// metrics in registration order: {name, help, type, values: Map(labels -> value), buckets, collect}
+let metrics = [];
+let server = null;
+
+function register(name, help, type) {
+  let metric = { name: PREFIX + name, help: help, type: type, values: new Map(), buckets: null, collect: null };
+  metrics.push(metric);
+  return metric;
+}
+
+// labels object as the text between braces, e.g. reason="mic"
+function formatLabels(labels) {
+  if (!labels) {
+    return '';
+  }
+  return Object.keys(labels).map(key => `${key}="${escapeLabel(String(labels[key]))}"`).join(',');
+}
+
+// label value escapes of the text exposition format: backslash, double quote and line feed
+function escapeLabel(value) {
+  return value.replace(/\\/g, '\\\\').replace(/"/g, '\\"').replace(/\n/g, '\\n');
+}
+
+function counter(name, help) {
+  let metric = register(name, help, 'counter');
+  return {
+    inc: (labels, value) => {
+      let key = formatLabels(labels);
+      metric.values.set(key, (metric.values.get(key) || 0) + (value === undefined ? 1 : value));
+    }
+  };
+}
+
+// buckets are the upper bounds, +Inf is added
+function histogram(name, help, buckets) {
+  let metric = register(name, help, 'histogram');
+  metric.buckets = buckets;
+  return {
+    observe: (labels, value) => {
+      let key = formatLabels(labels);
+      let entry = metric.values.get(key);
+      if (entry === undefined) {
+        entry = { counts: new Array(buckets.length).fill(0), count: 0, sum: 0 };
+        metric.values.set(key, entry);
+      }
+      for (let i = 0; i < buckets.length; i++) {
+        if (value <= buckets[i]) {
+          entry.counts[i]++;
+        }
+      }
+      entry.count++;
+      entry.sum += value;
+    }
+  };
+}
+
+// collect() returns the value, or a list of [labels, value]; type is 'gauge' or 'counter'
+function collector(name, help, type, collect) {
+  let metric = register(name, help, type);
+  metric.collect = collect;
+}
+
+function render() {
+  let lines = [];
+  for (let metric of metrics) {
+    lines.push(`# HELP ${metric.name} ${metric.help}`);
+    lines.push(`# TYPE ${metric.name} ${metric.type}`);
+
+    if (metric.collect) {
+      let value = metric.collect();
+      let samples = Array.isArray(value) ? value : [[null, value]];
+      for (let [labels, sample] of samples) {
+        let key = formatLabels(labels);
+        lines.push(`${metric.name}${key ? '{' + key + '}' : ''} ${sample}`);
+      }
+    } else if (metric.buckets) {
+      for (let [key, entry] of metric.values) {
+        let sep = key ? ',' : '';
+        metric.buckets.forEach((bound, i) => lines.push(`${metric.name}_bucket{${key}${sep}le="${bound}"} ${entry.counts[i]}`));
+        lines.push(`${metric.name}_bucket{${key}${sep}le="+Inf"} ${entry.count}`);
+        lines.push(`${metric.name}_sum${key ? '{' + key + '}' : ''} ${entry.sum}`);
+        lines.push(`${metric.name}_count${key ? '{' + key + '}' : ''} ${entry.count}`);
+      }
+    } else {
+      for (let [key, value] of metric.values) {
+        lines.push(`${metric.name}${key ? '{' + key + '}' : ''} ${value}`);
+      }
+    }
+  }
+  return lines.join('\n') + '\n';
+}
+
+function start(port, host) {
+  server = http.createServer((req, res) => {
+    if (req.url != '/metrics') {
+      res.writeHead(404);
+      res.end();
+      return;
+    }
+    res.writeHead(200, { 'Content-Type': 'text/plain; version=0.0.4' });
+    res.end(render());
+  });
+  server.on('error', err => console.log("Error: metrics endpoint: " + err.message));
+  server.listen(port, host || '127.0.0.1', () => console.log(`Metrics on http://${host || '127.0.0.1'}:${port}/metrics`));
+}
+
+function enabled() {
+  return server != null;
+}
+
+module.exports.counter = counter;
+module.exports.histogram = histogram;
+module.exports.collector = collector;
+module.exports.render = render;
+module.exports.start = start;
+module.exports.enabled = enabled;
@@ -1,4 +1,6 @@
 const mqtt = require('mqtt')
+const outbox = require('./outbox.js')
+const downlink = require('./downlink.js')
 
 let config;
 try {
@@ -9,7 +11,42 @@ try {
 }
 
 status_connected = false;
-on_or_off = 0;
+
+// Telemetry batching: readings are collected and published as one ThingsBoard
+// telemetry array when batch_size readings are queued or batch_interval ms have
+// passed since the first one, whichever comes first
+const TELEMETRY_TOPIC = 'v1/devices/me/telemetry';
+const batch_size = config.mqtt_batch_size || 1;
+const batch_interval = config.mqtt_batch_interval || 0;
+let batch = [];
+let batch_timer = null;
+
+// Gateway mode: the bridge publishes as a ThingsBoard gateway, each mesh node is a
+// device of its own. A batch becomes one {device: [{ts, values}]} publish, and each
+// device is announced on the connect topic before its first telemetry
+const GATEWAY_CONNECT_TOPIC = 'v1/gateway/connect';
+const GATEWAY_TELEMETRY_TOPIC = 'v1/gateway/telemetry';
+const GATEWAY_DEVICE_TYPE = 'mesh sensor';
+const gateway = config.mqtt_gateway || false;
+const telemetry_topic = gateway ? GATEWAY_TELEMETRY_TOPIC : TELEMETRY_TOPIC;
+// devices announced on the current MQTT connection
+let connected_devices = new Set();
+
+// telemetry publishes acknowledged and failed, see getStats()
+let stats = {
+  published: 0,
+  publish_errors: 0
+};
+// observer(seconds) of the time from publish to PUBACK, null when not measured
+let publish_observer = null;
+
+// Outbox: telemetry that can't be published is stored on disk and drained in
+// order, at most drain_rate publishes per second, once the broker is back
+const drain_rate = config.outbox_drain_rate || 10;
+let draining = false;
+if (config.outbox_dir) {
+  outbox.init(config.outbox_dir, config.outbox_max_bytes || 10 * 1024 * 1024);
+}
 
 var client  = mqtt.connect(
   config.mqtt_url,
@@ -18,27 +55,154 @@ var client  = mqtt.connect(
   }
 )
 
-function send_data(data) {
-  if (!status_connected) {
-    console.log("Error: publishing failed, MQTT is disconnected.")
-    return false;
+// queue a reading; ts is the time in ms the mesh PDU was received, defaults to now,
+// device the name of the mesh node in gateway mode
+function send_data(data, ts, device) {
+  batch.push({ts: ts || Date.now(), values: data, device: device});
+
+  if (batch.length >= batch_size) {
+    return flush();
+  }
+  if (batch_timer == null) {
+    batch_timer = setTimeout(flush, batch_interval);
+  }
+  return true;
+}
+
+// publish the queued readings as a single telemetry array
+function flush() {
+  if (batch_timer != null) {
+    clearTimeout(batch_timer);
+    batch_timer = null;
+  }
+  if (batch.length == 0) {
+    return true;
   }
 
-  let encoded = JSON.stringify(data)
-  client.publish('v1/devices/me/telemetry', encoded)
+  let encoded = encode(batch);
+  batch = [];
+
+  // queued telemetry goes out first, to keep readings in order
+  if (!status_connected || !outbox.isEmpty()) {
+    return store(encoded);
+  }
+
+  connect_devices(encoded);
+  let started = Date.now();
+  client.publish(telemetry_topic, encoded, {qos: 1}, err => {
+    published(started, err);
+    if (err) {
+      store(encoded);
+    }
+  })
   // console.log("Publishing: " + encoded)
 
   return true;
 }
 
+// telemetry payload of the readings: a ThingsBoard telemetry array, or in gateway
+// mode the readings of each device under its name
+function encode(readings) {
+  if (!gateway) {
+    return JSON.stringify(readings.map(reading => ({ts: reading.ts, values: reading.values})));
+  }
+
+  let devices = {};
+  for (let reading of readings) {
+    if (!(reading.device in devices)) {
+      devices[reading.device] = [];
+    }
+    devices[reading.device].push({ts: reading.ts, values: reading.values});
+  }
+  return JSON.stringify(devices);
+}
+
+// announce the devices of a gateway telemetry payload not announced yet on this connection;
+// publishes on a connection are delivered in order, so they precede the telemetry
+function connect_devices(encoded) {
+  if (!gateway) {
+    return;
+  }
+  for (let device of Object.keys(JSON.parse(encoded))) {
+    if (connected_devices.has(device)) {
+      continue;
+    }
+    connected_devices.add(device);
+    client.publish(GATEWAY_CONNECT_TOPIC, JSON.stringify({device: device, type: GATEWAY_DEVICE_TYPE}), {qos: 1});
+  }
+}
+
+function published(started, err) {
+  if (err) {
+    stats.publish_errors++;
+    return;
+  }
+  stats.published++;
+  if (publish_observer) {
+    publish_observer((Date.now() - started) / 1000);
+  }
+}
+
+function store(encoded) {
+  if (!outbox.append(encoded)) {
+    console.log("Error: publishing failed, MQTT is disconnected.")
+    return false;
+  }
+  if (status_connected && !draining) {
+    drain();
+  }
+  return true;
+}
+
+// publish the outbox content, one payload at a time
+function drain() {
+  if (!status_connected) {
+    draining = false;
+    return;
+  }
+
+  let encoded = outbox.peek();
+  if (encoded == null) {
+    draining = false;
+    console.log("Outbox drained")
+    return;
+  }
+
+  draining = true;
+  connect_devices(encoded);
+  let started = Date.now();
+  client.publish(telemetry_topic, encoded, {qos: 1}, err => {
+    published(started, err);
+    if (err) {
+      draining = false;
+      return;
+    }
+    outbox.shift();
+    setTimeout(drain, 1000 / drain_rate);
+  })
+}
+
 client.on('connect', function () {
-  console.log("MQTT connected to: " + config.mqtt_url)
+  console.log("MQTT connected to: " + config.mqtt_url + (gateway ? " as gateway" : ""))
   status_connected = true;
 
+  if (!outbox.isEmpty() && !draining) {
+    console.log("Draining outbox: " + outbox.getStats().bytes + " bytes")
+    drain();
+  }
+
   // subscribe to RPCs from the server to this device
   client.subscribe('v1/devices/me/rpc/request/+')
 })
 
+client.on('close', function () {
+  if (status_connected) {
+    console.log("MQTT disconnected, telemetry will be stored in the outbox")
+  }
+  status_connected = false;
+  connected_devices.clear();
+})
+
 client.on('message', function (topic, message) {
   // console.log('Received RPC message');
   // console.log('request.topic: ' + topic);
@@ -48,14 +212,27 @@ client.on('message', function (topic, message) {
 
   if (request.method == "onoff-set") {
     var params = JSON.parse(request.params);
-    on_or_off = params.onoff;
-    // console.log("Generic onoff message set with value " + on_or_off + " ready for sending.");
+    downlink.push({type: 'onoff', dst: config.hex_LED_alert_target, onoff: params.onoff});
+    // console.log("Generic onoff message set with value " + params.onoff + " queued for sending.");
   }
 });
 
-function check_new_onoff(){
-  return on_or_off;
+function setPublishObserver(observer) {
+  publish_observer = observer;
+}
+
+// publish counters, readings waiting for the next batch and outbox size
+function getStats() {
+  return {
+    connected: status_connected,
+    published: stats.published,
+    publish_errors: stats.publish_errors,
+    batch_depth: batch.length,
+    outbox_bytes: outbox.getStats().bytes
+  };
 }
 
 module.exports.send_data = send_data;
-module.exports.check_new_onoff = check_new_onoff;
\ No newline at end of file
+module.exports.flush = flush;
+module.exports.setPublishObserver = setPublishObserver;
+module.exports.getStats = getStats;
\ No newline at end of file
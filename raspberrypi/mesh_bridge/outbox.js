@@ -0,0 +1,157 @@
+//--------------------------------------------------------------
+// Store-and-forward outbox for telemetry
+// Payloads that can't be published are appended to a log of
+// segment files on disk, one payload per line, and drained in
+// order once the broker is reachable again. The log is bounded
+// in bytes: when full, the oldest segment is evicted.
+//--------------------------------------------------------------
+const fs = require('fs');
+const path = require('path');
+
+// segments are rolled at this size, so eviction drops small chunks of data
+const SEGMENT_MAX = 64 * 1024;
+
+let dir = null;
+let max_bytes = 0;
+let segment_max = SEGMENT_MAX;
+
+// segment file names, oldest first, and their sizes
+let segments = [];
+let sizes = new Map();
+let total_bytes = 0;
+let next_segment = 0;
+// segment being appended to, null to start a new one
+let write_segment = null;
+
+// oldest segment loaded for draining
+let read_segment = null;
+let read_lines = [];
+let read_index = 0;
+
+let evicted_bytes = 0;
+
+function segmentName(n) {
+  return n.toString().padStart(8, '0') + '.log';
+}
+
+function init(outbox_dir, outbox_max_bytes) {
+  dir = outbox_dir;
+  max_bytes = outbox_max_bytes;
+  segment_max = Math.min(SEGMENT_MAX, Math.max(1024, Math.floor(max_bytes / 4)));
+
+  fs.mkdirSync(dir, { recursive: true });
+  segments = fs.readdirSync(dir).filter(name => name.endsWith('.log')).sort();
+  for (let name of segments) {
+    let size = fs.statSync(path.join(dir, name)).size;
+    sizes.set(name, size);
+    total_bytes += size;
+  }
+  if (segments.length > 0) {
+    next_segment = parseInt(segments[segments.length - 1]) + 1;
+  }
+
+  if (total_bytes > 0) {
+    console.log(`Outbox: ${total_bytes} bytes in ${segments.length} segments waiting to be published`);
+  }
+}
+
+function removeOldest() {
+  let name = segments.shift();
+  total_bytes -= sizes.get(name);
+  sizes.delete(name);
+  if (name == read_segment) {
+    read_segment = null;
+    read_lines = [];
+    read_index = 0;
+  }
+  if (name == write_segment) {
+    write_segment = null;
+  }
+  try {
+    fs.unlinkSync(path.join(dir, name));
+  } catch (err) {
+    console.log("Error removing outbox segment: " + err.message);
+  }
+  return name;
+}
+
+// store a payload at the end of the log
+function append(payload) {
+  if (dir == null) {
+    return false;
+  }
+
+  let line = payload + '\n';
+  let length = Buffer.byteLength(line);
+
+  if (write_segment == null || sizes.get(write_segment) + length > segment_max) {
+    write_segment = segmentName(next_segment++);
+    segments.push(write_segment);
+    sizes.set(write_segment, 0);
+  }
+
+  try {
+    fs.appendFileSync(path.join(dir, write_segment), line);
+  } catch (err) {
+    console.log("Error writing to outbox: " + err.message);
+    return false;
+  }
+  sizes.set(write_segment, sizes.get(write_segment) + length);
+  total_bytes += length;
+
+  // oldest-first eviction
+  while (total_bytes > max_bytes && segments.length > 1) {
+    let name = segments[0];
+    evicted_bytes += sizes.get(name);
+    removeOldest();
+    console.log(`Outbox full: evicted oldest segment ${name}`);
+  }
+  return true;
+}
+
+function isEmpty() {
+  return segments.length == 0;
+}
+
+// oldest payload in the log, null if empty
+function peek() {
+  while (read_index >= read_lines.length) {
+    if (read_segment != null) {
+      // segment fully drained
+      removeOldest();
+    }
+    if (segments.length == 0) {
+      return null;
+    }
+
+    // the segment being appended to is closed before reading it
+    read_segment = segments[0];
+    if (read_segment == write_segment) {
+      write_segment = null;
+    }
+    read_lines = fs.readFileSync(path.join(dir, read_segment), 'utf8').split('\n');
+    read_lines.pop(); // after the last newline
+    read_index = 0;
+  }
+  return read_lines[read_index];
+}
+
+// remove the payload returned by peek(), once it has been published
+function shift() {
+  read_index++;
+}
+
+function getStats() {
+  return {
+    bytes: total_bytes,
+    segments: segments.length,
+    evicted_bytes: evicted_bytes
+  };
+}
+
+module.exports.init = init;
+module.exports.append = append;
+module.exports.isEmpty = isEmpty;
+module.exports.peek = peek;
+module.exports.shift = shift;
+module.exports.getStats = getStats;
@@ -0,0 +1,111 @@
+//--------------------------------------------------------------
+// Proxy filter configuration - ref 6.4 and 6.5
+// The proxy node only forwards over GATT the network PDUs whose
+// destination passes the filter of the connection. The filter is
+// reset on each connection, so it is configured once a link is
+// ready. Every Proxy Configuration message is answered with a
+// Filter Status, which is checked against the expected list.
+//--------------------------------------------------------------
+
+// proxy configuration opcodes - ref 6.7
+const OPCODE_SET_FILTER_TYPE = 0x00;
+const OPCODE_ADD_ADDRESSES = 0x01;
+const OPCODE_REMOVE_ADDRESSES = 0x02;
+const OPCODE_FILTER_STATUS = 0x03;
+
+// filter types - ref 6.4.1
+const FILTER_ACCEPT = 0x00; // white list
+const FILTER_REJECT = 0x01; // black list
+
+// a proxy configuration message takes one network PDU: 12 bytes with the 64-bit NetMIC
+const ADDRESSES_PER_MESSAGE = 5;
+
+// filter state of a proxy link
+function createFilter() {
+  return {
+    type: -1,
+    addresses: new Set(),
+    // Filter Status messages still to come
+    pending: 0,
+    status_type: -1,
+    status_size: -1,
+    statuses: 0,
+    mismatches: 0
+  };
+}
+
+function message(opcode, addresses) {
+  let pdu = Buffer.alloc(1 + addresses.length * 2);
+  pdu[0] = opcode;
+  addresses.forEach((address, i) => pdu.writeUInt16BE(address, 1 + i * 2));
+  return pdu;
+}
+
+function addressMessages(opcode, addresses) {
+  let messages = [];
+  for (let i = 0; i < addresses.length; i += ADDRESSES_PER_MESSAGE) {
+    messages.push(message(opcode, addresses.slice(i, i + ADDRESSES_PER_MESSAGE)));
+  }
+  return messages;
+}
+
+// Proxy Configuration messages (opcode | parameters) moving the filter to the given
+// type and address list: the type is set first, which clears the list, then
+// addresses are removed or added as needed
+function configure(filter, type, addresses) {
+  let messages = [];
+  if (type != filter.type) {
+    messages.push(Buffer.from([OPCODE_SET_FILTER_TYPE, type]));
+    filter.type = type;
+    filter.addresses.clear();
+  }
+
+  let wanted = new Set(addresses);
+  let removed = [...filter.addresses].filter(address => !wanted.has(address));
+  let added = [...wanted].filter(address => !filter.addresses.has(address));
+  messages.push(...addressMessages(OPCODE_REMOVE_ADDRESSES, removed));
+  messages.push(...addressMessages(OPCODE_ADD_ADDRESSES, added));
+
+  filter.addresses = wanted;
+  filter.pending += messages.length;
+  return messages;
+}
+
+// forget the configured state, so that the next configure() starts over
+function reset(filter) {
+  filter.type = -1;
+  filter.addresses.clear();
+  filter.pending = 0;
+}
+
+// Filter Status received: FilterType (1) | ListSize (2). Returns false if, once all the
+// replies have been received, the proxy filter doesn't match the configured one
+function onStatus(filter, params) {
+  if (params.length < 3) {
+    return true;
+  }
+  filter.status_type = params[0];
+  filter.status_size = (params[1] << 8) | params[2];
+  filter.statuses++;
+  if (filter.pending > 0) {
+    filter.pending--;
+  }
+  if (filter.pending > 0) {
+    return true;
+  }
+
+  // the proxy may hold more addresses, e.g. it adds the source of the PDUs the bridge sends
+  if (filter.status_type != filter.type || filter.status_size < filter.addresses.size) {
+    filter.mismatches++;
+    return false;
+  }
+  return true;
+}
+
+module.exports.OPCODE_FILTER_STATUS = OPCODE_FILTER_STATUS;
+module.exports.FILTER_ACCEPT = FILTER_ACCEPT;
+module.exports.FILTER_REJECT = FILTER_REJECT;
+module.exports.createFilter = createFilter;
+module.exports.configure = configure;
+module.exports.reset = reset;
+module.exports.onStatus = onStatus;
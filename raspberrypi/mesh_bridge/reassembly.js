@@ -0,0 +1,161 @@
+//--------------------------------------------------------------
+// Segmented message reassembly
+// - Proxy SAR (6.3.2): one reassembly buffer per GATT link, as
+//   proxy segments of a link are never interleaved.
+// - Lower transport (3.5.3.3): one context per (SRC, SeqZero), so
+//   segmented messages from different nodes can interleave.
+//   Contexts are preallocated from SegN, evicted by the incomplete
+//   timer and capped in number.
+//--------------------------------------------------------------
+
+// largest reassembled proxy PDU accepted (provisioning PDUs are the longest)
+const PROXY_PDU_MAX = 128;
+// segmented access messages carry up to 12 bytes per segment
+const SEGMENT_SIZE = 12;
+// incomplete timer, at least 10 seconds - ref 3.5.3.4
+const INCOMPLETE_TIMEOUT = 10000;
+// expired contexts are looked for at most with this period
+const SWEEP_INTERVAL = 1000;
+// open contexts cap, the oldest is evicted when exceeded
+const MAX_CONTEXTS = 64;
+
+let contexts = new Map();
+let last_sweep = 0;
+
+let stats = {
+  completed: 0,
+  timed_out: 0,
+  evicted: 0,
+  inconsistent: 0
+};
+
+//------------------
+// Proxy SAR
+//------------------
+function createProxyReassembly() {
+  return {
+    buffer: Buffer.alloc(PROXY_PDU_MAX),
+    length: 0,
+    active: false
+  };
+}
+
+// first segment, including the proxy PDU header
+function proxyStart(link, octets) {
+  if (octets.length > PROXY_PDU_MAX) {
+    link.active = false;
+    return false;
+  }
+  link.buffer.set(octets, 0);
+  link.length = octets.length;
+  link.active = true;
+  return true;
+}
+
+// continuation or last segment, without the proxy PDU header
+function proxyAppend(link, octets) {
+  if (!link.active || link.length + octets.length > PROXY_PDU_MAX) {
+    link.active = false;
+    return false;
+  }
+  link.buffer.set(octets, link.length);
+  link.length += octets.length;
+  return true;
+}
+
+// reassembled proxy PDU; it is a view on the link buffer, valid until the next segment on the link
+function proxyFinish(link) {
+  link.active = false;
+  return link.buffer.subarray(0, link.length);
+}
+
+//------------------------
+// Lower transport SAR
+//------------------------
+function contextKey(src, seq_zero) {
+  return (src << 13) | seq_zero;
+}
+
+function sweep(now) {
+  last_sweep = now;
+  for (let [key, ctx] of contexts) {
+    if (now - ctx.started > INCOMPLETE_TIMEOUT) {
+      contexts.delete(key);
+      stats.timed_out++;
+    }
+  }
+}
+
+function newContext(seg_n, now) {
+  return {
+    seg_n: seg_n,
+    buffer: Buffer.alloc((seg_n + 1) * SEGMENT_SIZE),
+    received: 0,
+    expected: seg_n == 31 ? 0xFFFFFFFF : ((1 << (seg_n + 1)) - 1) >>> 0,
+    length: seg_n * SEGMENT_SIZE,
+    started: now
+  };
+}
+
+// Store segment seg_o of seg_n (3.5.2.2). Returns the reassembled upper transport
+// PDU once every segment has been received, null otherwise.
+function addSegment(src, seq_zero, seg_o, seg_n, data) {
+  let now = Date.now();
+  if (now - last_sweep > SWEEP_INTERVAL) {
+    sweep(now);
+  }
+
+  // all segments but the last one are full
+  if (seg_o > seg_n || data.length == 0 || data.length > SEGMENT_SIZE ||
+      (seg_o < seg_n && data.length != SEGMENT_SIZE)) {
+    stats.inconsistent++;
+    return null;
+  }
+
+  let key = contextKey(src, seq_zero);
+  let ctx = contexts.get(key);
+  if (ctx !== undefined && ctx.seg_n != seg_n) {
+    // SegN changed: a new message reusing the SeqZero, restart
+    contexts.delete(key);
+    stats.inconsistent++;
+    ctx = undefined;
+  }
+  if (ctx === undefined) {
+    if (contexts.size >= MAX_CONTEXTS) {
+      contexts.delete(contexts.keys().next().value);
+      stats.evicted++;
+    }
+    ctx = newContext(seg_n, now);
+    contexts.set(key, ctx);
+  }
+
+  ctx.buffer.set(data, seg_o * SEGMENT_SIZE);
+  ctx.received = (ctx.received | (1 << seg_o)) >>> 0;
+  if (seg_o == seg_n) {
+    ctx.length = seg_n * SEGMENT_SIZE + data.length;
+  }
+
+  if (ctx.received != ctx.expected) {
+    return null;
+  }
+
+  contexts.delete(key);
+  stats.completed++;
+  return ctx.buffer.subarray(0, ctx.length);
+}
+
+function openContexts() {
+  return contexts.size;
+}
+
+function getStats() {
+  return stats;
+}
+
+module.exports.createProxyReassembly = createProxyReassembly;
+module.exports.proxyStart = proxyStart;
+module.exports.proxyAppend = proxyAppend;
+module.exports.proxyFinish = proxyFinish;
+module.exports.addSegment = addSegment;
+module.exports.openContexts = openContexts;
+module.exports.getStats = getStats;
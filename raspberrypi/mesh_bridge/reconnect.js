@@ -0,0 +1,86 @@
+//--------------------------------------------------------------
+// Proxy reconnection
+// A proxy that drops the link is reconnected directly, without
+// scanning for it again, with exponential backoff and jitter so
+// that a rebooting proxy isn't hammered. After too many failed
+// attempts the bridge goes back to scanning. The time from the
+// disconnection to the link being usable again is recorded in
+// a histogram.
+//--------------------------------------------------------------
+
+// first reconnection delay, doubled after each failed attempt up to BACKOFF_MAX, ms
+const BACKOFF_BASE = 100;
+const BACKOFF_MAX = 10000;
+// failed attempts before going back to scanning
+const MAX_ATTEMPTS = 8;
+// histogram bucket upper bounds, ms
+const HISTOGRAM_BOUNDS = [250, 500, 1000, 2000, 5000, 10000, 30000, Infinity];
+
+// reconnections in progress by peripheral id: {started, attempts}
+let pending = new Map();
+
+let histogram = new Array(HISTOGRAM_BOUNDS.length).fill(0);
+let stats = {
+  reconnects: 0,
+  attempts: 0,
+  gave_up: 0
+};
+
+// delay before the next connection attempt to the peripheral, -1 to give up and scan
+function nextDelay(id) {
+  let state = pending.get(id);
+  if (state === undefined) {
+    state = { started: Date.now(), attempts: 0 };
+    pending.set(id, state);
+  }
+  if (state.attempts >= MAX_ATTEMPTS) {
+    pending.delete(id);
+    stats.gave_up++;
+    return -1;
+  }
+
+  // "equal jitter": half of the backoff is fixed, half random
+  let backoff = Math.min(BACKOFF_MAX, BACKOFF_BASE * Math.pow(2, state.attempts));
+  state.attempts++;
+  stats.attempts++;
+  return Math.round(backoff / 2 + Math.random() * backoff / 2);
+}
+
+function isPending(id) {
+  return pending.has(id);
+}
+
+function pendingCount() {
+  return pending.size;
+}
+
+// the link to the peripheral is usable again
+function ready(id) {
+  let state = pending.get(id);
+  if (state === undefined) {
+    return;
+  }
+  pending.delete(id);
+
+  let elapsed = Date.now() - state.started;
+  let bucket = HISTOGRAM_BOUNDS.findIndex(bound => elapsed <= bound);
+  histogram[bucket]++;
+  stats.reconnects++;
+}
+
+// histogram as text, e.g. "<=250ms: 3, <=500ms: 1, ..."
+function formatHistogram() {
+  return HISTOGRAM_BOUNDS.map((bound, i) =>
+    (bound == Infinity ? '>30000ms' : `<=${bound}ms`) + `: ${histogram[i]}`).join(', ');
+}
+
+function getStats() {
+  return stats;
+}
+
+module.exports.nextDelay = nextDelay;
+module.exports.isPending = isPending;
+module.exports.pendingCount = pendingCount;
+module.exports.ready = ready;
+module.exports.formatHistogram = formatHistogram;
+module.exports.getStats = getStats;
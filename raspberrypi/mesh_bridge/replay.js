@@ -0,0 +1,116 @@
+//--------------------------------------------------------------
+// Replay protection list - ref 3.8.8
+// Keeps the latest SeqAuth and IV index accepted from each
+// unicast source address. Entries live in typed arrays indexed
+// by SRC, so lookup and update are O(1) for the whole 0x0001 -
+// 0x7FFF range. The list can optionally be persisted to a file
+// so that a restart doesn't accept old messages again.
+//--------------------------------------------------------------
+const fs = require('fs');
+
+const UNICAST_ADDRESSES = 0x8000;
+// persisted entry: SRC (2), IV index (4), SeqAuth (3)
+const ENTRY_SIZE = 9;
+
+let seq_auths = new Int32Array(UNICAST_ADDRESSES).fill(-1);
+let iv_indexes = new Uint32Array(UNICAST_ADDRESSES);
+
+let rpl_file = null;
+let dirty = false;
+
+// true if a message from src with the given IV index and SeqAuth has already been accepted
+function isReplay(src, iv_index, seq_auth) {
+  let last_seq = seq_auths[src];
+  if (last_seq < 0) {
+    return false;
+  }
+  if (iv_index != iv_indexes[src]) {
+    return iv_index < iv_indexes[src];
+  }
+  return seq_auth <= last_seq;
+}
+
+// record a message once it has been authenticated
+function update(src, iv_index, seq_auth) {
+  seq_auths[src] = seq_auth;
+  iv_indexes[src] = iv_index;
+  dirty = true;
+}
+
+function clear() {
+  seq_auths.fill(-1);
+  iv_indexes.fill(0);
+  dirty = true;
+}
+
+function save() {
+  if (rpl_file == null || !dirty) {
+    return;
+  }
+
+  let count = 0;
+  for (let src = 1; src < UNICAST_ADDRESSES; src++) {
+    if (seq_auths[src] >= 0) {
+      count++;
+    }
+  }
+
+  let data = Buffer.alloc(count * ENTRY_SIZE);
+  let offset = 0;
+  for (let src = 1; src < UNICAST_ADDRESSES; src++) {
+    if (seq_auths[src] < 0) {
+      continue;
+    }
+    data.writeUInt16BE(src, offset);
+    data.writeUInt32BE(iv_indexes[src], offset + 2);
+    data.writeUIntBE(seq_auths[src], offset + 6, 3);
+    offset += ENTRY_SIZE;
+  }
+
+  // write and rename, so that a crash never leaves a truncated list behind
+  let tmp_file = rpl_file + '.tmp';
+  try {
+    fs.writeFileSync(tmp_file, data);
+    fs.renameSync(tmp_file, rpl_file);
+    dirty = false;
+  } catch (err) {
+    console.log("Error saving replay protection list: " + err.message);
+  }
+}
+
+function load(file) {
+  let data;
+  try {
+    data = fs.readFileSync(file);
+  } catch (err) {
+    return 0;
+  }
+
+  let count = Math.floor(data.length / ENTRY_SIZE);
+  for (let i = 0; i < count; i++) {
+    let offset = i * ENTRY_SIZE;
+    let src = data.readUInt16BE(offset);
+    if (src < 1 || src >= UNICAST_ADDRESSES) {
+      continue;
+    }
+    iv_indexes[src] = data.readUInt32BE(offset + 2);
+    seq_auths[src] = data.readUIntBE(offset + 6, 3);
+  }
+  return count;
+}
+
+// restore the list from file and save it back every save_interval ms and on exit
+function enablePersistence(file, save_interval) {
+  rpl_file = file;
+  let count = load(file);
+  console.log(`Replay protection list: ${count} sources restored from ${file}`);
+
+  setInterval(save, save_interval).unref();
+  process.on('exit', save);
+}
+
+module.exports.isReplay = isReplay;
+module.exports.update = update;
+module.exports.clear = clear;
+module.exports.save = save;
+module.exports.enablePersistence = enablePersistence;
@@ -0,0 +1,194 @@
+//--------------------------------------------------------------
+// Lower transport segmentation for outgoing messages - ref 3.5.3
+// An upper transport PDU too long for a single network PDU is
+// split in segments of 12 bytes, written as a paced pipeline.
+// Unicast destinations acknowledge the received segments with a
+// Segment Acknowledgment message: missing segments are sent again
+// when the acknowledgment timer expires, up to a retry limit.
+// Group and virtual destinations don't acknowledge, so segments
+// are sent a fixed number of times.
+//--------------------------------------------------------------
+
+// segmented access messages carry up to 12 bytes per segment
+const SEGMENT_SIZE = 12;
+const MAX_SEGMENTS = 32;
+// unsegmented access messages carry up to 15 bytes, TransMIC included
+const UNSEGMENTED_MAX = 15;
+// pause between two segments, so the proxy isn't flooded
+const SEGMENT_INTERVAL = 20;
+// segment transmission timer, 200 + 50 * TTL ms - ref 3.5.3.3
+const ACK_TIMEOUT_BASE = 200;
+const ACK_TIMEOUT_PER_TTL = 50;
+// transmissions of the unacknowledged segments to unicast destinations
+const UNICAST_ATTEMPTS = 4;
+// transmissions of all segments to group and virtual destinations
+const GROUP_ATTEMPTS = 2;
+
+// the transfer in progress, one at a time
+let current = null;
+
+let stats = {
+  transfers: 0,
+  completed: 0,
+  failed: 0,
+  segments_sent: 0,
+  segments_resent: 0
+};
+
+// true if the upper transport PDU needs segmentation, given the access payload length
+function isSegmented(access_payload_length) {
+  return access_payload_length + 4 > UNSEGMENTED_MAX;
+}
+
+// SZMIC for a segmented access payload: the 64-bit TransMIC is used when it doesn't
+// need one more segment than the 32-bit one. Returns -1 if the payload can't fit.
+function selectSzmic(access_payload_length) {
+  let segments_32 = Math.ceil((access_payload_length + 4) / SEGMENT_SIZE);
+  let segments_64 = Math.ceil((access_payload_length + 8) / SEGMENT_SIZE);
+  if (segments_32 > MAX_SEGMENTS) {
+    return -1;
+  }
+  return segments_64 == segments_32 ? 1 : 0;
+}
+
+// split an upper transport PDU in segmented access lower transport PDUs - ref 3.5.2.2
+function segment(upper_transport_pdu, akf, aid, szmic, seq_zero) {
+  let seg_n = Math.ceil(upper_transport_pdu.length / SEGMENT_SIZE) - 1;
+  let pdus = [];
+
+  for (let seg_o = 0; seg_o <= seg_n; seg_o++) {
+    let data = upper_transport_pdu.subarray(seg_o * SEGMENT_SIZE, (seg_o + 1) * SEGMENT_SIZE);
+    let pdu = Buffer.alloc(4 + data.length);
+    // SEG AKF AID | SZMIC SeqZero SegO SegN
+    pdu[0] = 0x80 | (akf << 6) | aid;
+    pdu.writeUIntBE(((szmic << 23) | (seq_zero << 10) | (seg_o << 5) | seg_n) >>> 0, 1, 3);
+    pdu.set(data, 4);
+    pdus.push(pdu);
+  }
+  return pdus;
+}
+
+// tx: {dst, seq_zero, ttl, pdus}, the lower transport PDUs to send
+// write_fn(tx, index, callback): sends pdus[index] in a network PDU, callback(error) once written
+// done_fn(error): called once when the transfer is over
+function start(tx, write_fn, done_fn) {
+  tx.unicast = tx.dst > 0 && tx.dst < 0x8000;
+  tx.acked = 0;
+  tx.all = tx.pdus.length == 32 ? 0xFFFFFFFF : ((1 << tx.pdus.length) - 1) >>> 0;
+  tx.attempts = 0;
+  tx.rounds = 0;
+  tx.timer = null;
+  tx.writing = false;
+  tx.write_fn = write_fn;
+  tx.done_fn = done_fn;
+
+  current = tx;
+  stats.transfers++;
+  transmit(tx);
+}
+
+// send the segments not acknowledged yet
+function transmit(tx) {
+  let max_attempts = tx.unicast ? UNICAST_ATTEMPTS : GROUP_ATTEMPTS;
+  if (tx.attempts >= max_attempts) {
+    if (tx.unicast) {
+      finish(tx, new Error(`no acknowledgment from ${tx.dst.toString(16)} after ${tx.attempts} attempts`));
+    } else {
+      finish(tx, null);
+    }
+    return;
+  }
+  if (tx.rounds > 0) {
+    stats.segments_resent += tx.pdus.length - popcount(tx.acked);
+  }
+  tx.attempts++;
+  tx.rounds++;
+  tx.writing = true;
+  writeFrom(tx, 0);
+}
+
+function writeFrom(tx, index) {
+  if (tx != current) {
+    return;
+  }
+  while (index < tx.pdus.length && (tx.acked & (1 << index)) != 0) {
+    index++;
+  }
+  if (index >= tx.pdus.length) {
+    // round over, wait for the acknowledgment
+    tx.writing = false;
+    tx.timer = setTimeout(() => {
+      tx.timer = null;
+      transmit(tx);
+    }, ACK_TIMEOUT_BASE + ACK_TIMEOUT_PER_TTL * tx.ttl);
+    return;
+  }
+
+  tx.write_fn(tx, index, error => {
+    if (error) {
+      finish(tx, error);
+      return;
+    }
+    stats.segments_sent++;
+    setTimeout(() => writeFrom(tx, index + 1), SEGMENT_INTERVAL);
+  });
+}
+
+// Segment Acknowledgment received from src - ref 3.5.2.3.1
+function onAck(src, seq_zero, block_ack) {
+  let tx = current;
+  if (tx == null || !tx.unicast || src != tx.dst || seq_zero != tx.seq_zero) {
+    return;
+  }
+  if (block_ack == 0) {
+    // the destination can't receive the message, e.g. it is busy
+    finish(tx, new Error(`transfer cancelled by ${src.toString(16)}`));
+    return;
+  }
+
+  let acked = ((tx.acked | block_ack) & tx.all) >>> 0;
+  let progress = acked != tx.acked;
+  tx.acked = acked;
+  if (tx.acked == tx.all) {
+    finish(tx, null);
+  } else if (progress && !tx.writing) {
+    // missing segments are sent again right away, resetting the retry count
+    clearTimeout(tx.timer);
+    tx.timer = null;
+    tx.attempts = 0;
+    transmit(tx);
+  }
+}
+
+function finish(tx, error) {
+  if (tx != current) {
+    return;
+  }
+  current = null;
+  clearTimeout(tx.timer);
+  if (error) {
+    stats.failed++;
+  } else {
+    stats.completed++;
+  }
+  tx.done_fn(error);
+}
+
+function popcount(mask) {
+  let count = 0;
+  for (; mask != 0; mask >>>= 1) {
+    count += mask & 1;
+  }
+  return count;
+}
+
+function getStats() {
+  return stats;
+}
+
+module.exports.isSegmented = isSegmented;
+module.exports.selectSzmic = selectSzmic;
+module.exports.segment = segment;
+module.exports.start = start;
+module.exports.onAck = onAck;
+module.exports.getStats = getStats;
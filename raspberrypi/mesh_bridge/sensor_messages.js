@@ -0,0 +1,124 @@
+//--------------------------------------------------------------
+// Sensor messages
+// Decoding of the Sensor Status access messages published by the
+// mesh nodes into ThingsBoard telemetry, shared by the bridge and
+// the headless tools.
+//--------------------------------------------------------------
+
+// load configuration file
+let config;
+try {
+  config = require('./config');
+} catch (e) {
+  console.log("Did you set up the keys?");
+  process.exit(1);
+}
+
+// sensor property IDs, see things/sensor/lib/models
+const ID_TEMP_CELSIUS = 0x2A10;
+const ID_HUMIDITY = 0x2A11;
+const ID_PRESSURE = 0x2A12;
+const ID_GAS = 0x2A13;
+// compact THP status, a vendor message that fits in one unsegmented PDU, see thp_sensor.h
+const OPCODE_THP_COMPACT_STATUS = 0xC1;
+const COMPANY_ID = 0xFFFF;
+const THP_COMPACT_LAYOUT_V1 = 0x01;
+
+function read_short_le(octets, offset) {
+  return octets[offset] | (octets[offset + 1] << 8);
+}
+
+// message holds the access payload parameters as a Uint8Array, opcode and company_code
+// come from the decoder result
+function decode_message(sender, message, opcode, company_code) {
+  if (opcode === OPCODE_THP_COMPACT_STATUS && company_code === COMPANY_ID) {
+    return decode_thp_compact(get_name(sender), message);
+  }
+  if (message.length < 2) {
+    return {err: "unknown message"};
+  }
+  let name = get_name(sender);
+
+  switch (read_short_le(message, 0)) {
+    case ID_TEMP_CELSIUS:
+      return decode_thp(name, message);
+
+    case ID_GAS:
+      return decode_gas(name, message);
+
+    default:
+      // console.log("Error: unknown message");
+      return obj = {err: "unknown message"}
+      //return {}
+  }
+}
+
+function get_name(address) {
+  if (address in config.address_map) {
+    return config.address_map[address];
+  }
+
+  return address;
+}
+
+// in gateway mode each node is a ThingsBoard device of its own, otherwise all the
+// readings go to the bridge device with the node name as key suffix
+function telemetry_key(key, name) {
+  return config.mqtt_gateway ? key : key + '_' + name;
+}
+
+function decode_thp(name, message) {
+  if (
+    message.length < 12
+    || read_short_le(message, 0) !== ID_TEMP_CELSIUS
+    || read_short_le(message, 4) !== ID_HUMIDITY
+    || read_short_le(message, 8) !== ID_PRESSURE
+  ) {
+    console.log("Error: malformed thp message");
+    return {};
+  }
+
+  let obj = {};
+  obj[telemetry_key('temperature', name)] = read_short_le(message, 2) / 100;
+  obj[telemetry_key('humidity', name)] = read_short_le(message, 6) / 100;
+  obj[telemetry_key('pressure', name)] = read_short_le(message, 10) / 100;
+
+  return obj;
+}
+
+// layout tag, then temperature (signed), humidity and pressure multiplied by 100
+function decode_thp_compact(name, message) {
+  if (message.length < 7 || message[0] !== THP_COMPACT_LAYOUT_V1) {
+    console.log("Error: malformed compact thp message");
+    return {};
+  }
+
+  let obj = {};
+  obj[telemetry_key('temperature', name)] = (read_short_le(message, 1) << 16 >> 16) / 100;
+  obj[telemetry_key('humidity', name)] = read_short_le(message, 3) / 100;
+  obj[telemetry_key('pressure', name)] = read_short_le(message, 5) / 100;
+
+  return obj;
+}
+
+function decode_gas(name, message) {
+  if (message.length < 4 || read_short_le(message, 0) !== ID_GAS) {
+    console.log("Error: malformed gas message");
+    return {};
+  }
+
+  let obj = {};
+  obj[telemetry_key('co2_ppm', name)] = read_short_le(message, 2);
+
+  return obj;
+}
+
+module.exports.decode_message = decode_message;
+module.exports.get_name = get_name;
+module.exports.ID_TEMP_CELSIUS = ID_TEMP_CELSIUS;
+module.exports.ID_HUMIDITY = ID_HUMIDITY;
+module.exports.ID_PRESSURE = ID_PRESSURE;
+module.exports.ID_GAS = ID_GAS;
+module.exports.OPCODE_THP_COMPACT_STATUS = OPCODE_THP_COMPACT_STATUS;
+module.exports.COMPANY_ID = COMPANY_ID;
+module.exports.THP_COMPACT_LAYOUT_V1 = THP_COMPACT_LAYOUT_V1;
@@ -0,0 +1,81 @@
+//--------------------------------------------------------------
+// Sequence number allocation - ref 3.8.3
+// SEQ values are reserved in blocks: the file holds the end of
+// the current block, written atomically and fsync'ed once per
+// block instead of once per message. After a restart allocation
+// resumes from the stored value, skipping whatever was left of
+// the previous block, so a SEQ is never used twice.
+//--------------------------------------------------------------
+const fs = require('fs');
+const path = require('path');
+
+// 24-bit SEQ
+const SEQ_MAX = 0xFFFFFF;
+
+let seq_file = null;
+let block_size = 1000;
+let next_seq = 0;
+let reserved_until = 0; // first SEQ not reserved yet
+
+// write the file through a synced temp file and rename it, so that a crash
+// leaves either the old or the new value
+function writeAtomic(file, content) {
+  let tmp_file = file + '.tmp';
+  let fd = fs.openSync(tmp_file, 'w');
+  try {
+    fs.writeSync(fd, content);
+    fs.fsyncSync(fd);
+  } finally {
+    fs.closeSync(fd);
+  }
+  fs.renameSync(tmp_file, file);
+
+  // persist the rename
+  let dir_fd = fs.openSync(path.dirname(path.resolve(file)), 'r');
+  try {
+    fs.fsyncSync(dir_fd);
+  } finally {
+    fs.closeSync(dir_fd);
+  }
+}
+
+function reserve(until) {
+  reserved_until = Math.min(until, SEQ_MAX + 1);
+  writeAtomic(seq_file, reserved_until.toString());
+}
+
+function init(file, seq_block_size) {
+  seq_file = file;
+  if (seq_block_size) {
+    block_size = seq_block_size;
+  }
+
+  let data = null;
+  try {
+    data = fs.readFileSync(seq_file, 'utf8');
+  } catch (err) {
+    console.log('Creating seq file...');
+  }
+  next_seq = data ? parseInt(data) || 0 : 0;
+  reserve(next_seq + block_size);
+  console.log(`Sequence numbers: starting from ${next_seq}, reserved until ${reserved_until}`);
+}
+
+// allocate count consecutive sequence numbers, returns the first one or -1 if SEQ is exhausted
+function allocate(count) {
+  count = count || 1;
+  if (next_seq + count > SEQ_MAX + 1) {
+    console.log("ERROR: sequence numbers exhausted, an IV Update is required");
+    return -1;
+  }
+  if (next_seq + count > reserved_until) {
+    reserve(next_seq + count + block_size);
+  }
+
+  let seq = next_seq;
+  next_seq += count;
+  return seq;
+}
+
+module.exports.init = init;
+module.exports.allocate = allocate;
@@ -0,0 +1,135 @@
+//--------------------------------------------------------------
+// PDU traces
+// Raw GATT notifications with their reception time, as captured
+// by the bridge (config.capture_file) and fed back through the
+// decoder by trace_replay.js.
+// File:   "MBTR" | version (1) | RFU (3) | start, ms since epoch (8)
+// Record: type (1) | time since the previous record, us (4) |
+//         link (1) | length (1) | data
+// A link record names the link index of the notifications that
+// follow. Integers are big endian. Records are buffered and
+// written synchronously, so the file is complete on exit.
+//--------------------------------------------------------------
+const fs = require('fs');
+
+const MAGIC = 'MBTR';
+const VERSION = 1;
+const HEADER_SIZE = 16;
+const RECORD_HEADER_SIZE = 7;
+
+const RECORD_NOTIFICATION = 0;
+const RECORD_LINK = 1;
+
+// buffered records are written once this size is reached, or by flush()
+const FLUSH_SIZE = 64 * 1024;
+// longest gap between two records, about 71 minutes
+const DELTA_MAX = 0xFFFFFFFF;
+
+function createWriter(file) {
+  let header = Buffer.alloc(HEADER_SIZE);
+  header.write(MAGIC, 0, 'ascii');
+  header[4] = VERSION;
+  header.writeBigUInt64BE(BigInt(Date.now()), 8);
+
+  let writer = {
+    fd: fs.openSync(file, 'w'),
+    chunks: [header],
+    size: header.length,
+    origin: process.hrtime.bigint(),
+    last: 0,
+    links: new Map(),
+    records: 0
+  };
+  return writer;
+}
+
+// time is in us since the writer has been created
+function append(writer, type, link, data, time) {
+  let delta = Math.max(0, time - writer.last);
+  writer.last = time;
+
+  let record = Buffer.alloc(RECORD_HEADER_SIZE + data.length);
+  record[0] = type;
+  record.writeUInt32BE(Math.min(delta, DELTA_MAX), 1);
+  record[5] = link;
+  record[6] = data.length;
+  record.set(data, RECORD_HEADER_SIZE);
+
+  writer.chunks.push(record);
+  writer.size += record.length;
+  writer.records++;
+  if (writer.size >= FLUSH_SIZE) {
+    flush(writer);
+  }
+}
+
+// record a notification received on the link named link_id, now or at the given time in
+// us since the writer has been created, e.g. for synthetic traffic
+function write(writer, link_id, data, time) {
+  if (time === undefined) {
+    time = Number((process.hrtime.bigint() - writer.origin) / 1000n);
+  }
+  let link = writer.links.get(link_id);
+  if (link === undefined) {
+    link = writer.links.size & 0xFF;
+    writer.links.set(link_id, link);
+    append(writer, RECORD_LINK, link, Buffer.from(String(link_id), 'utf8'), time);
+  }
+  append(writer, RECORD_NOTIFICATION, link, data, time);
+}
+
+function flush(writer) {
+  if (writer.chunks.length == 0) {
+    return;
+  }
+  fs.writeSync(writer.fd, Buffer.concat(writer.chunks));
+  writer.chunks = [];
+  writer.size = 0;
+}
+
+function close(writer) {
+  flush(writer);
+  fs.closeSync(writer.fd);
+}
+
+// notifications of a trace file: {start, records: [{time, link, data}]}, time in us
+// since the start of the capture, link the link name. Throws on malformed files
+function read(file) {
+  let buffer = fs.readFileSync(file);
+  if (buffer.length < HEADER_SIZE || buffer.toString('ascii', 0, 4) != MAGIC) {
+    throw new Error("not a PDU trace: " + file);
+  }
+  if (buffer[4] != VERSION) {
+    throw new Error("unsupported trace version " + buffer[4]);
+  }
+
+  let trace = { start: Number(buffer.readBigUInt64BE(8)), records: [] };
+  let links = new Map();
+  let time = 0;
+  let offset = HEADER_SIZE;
+  while (offset + RECORD_HEADER_SIZE <= buffer.length) {
+    let type = buffer[offset];
+    let length = buffer[offset + 6];
+    let data = buffer.subarray(offset + RECORD_HEADER_SIZE, offset + RECORD_HEADER_SIZE + length);
+    if (data.length < length) {
+      // capture interrupted in the middle of a record
+      break;
+    }
+    time += buffer.readUInt32BE(offset + 1);
+
+    let link = buffer[offset + 5];
+    if (type == RECORD_LINK) {
+      links.set(link, data.toString('utf8'));
+    } else if (type == RECORD_NOTIFICATION) {
+      trace.records.push({ time: time, link: links.get(link) || String(link), data: Uint8Array.from(data) });
+    }
+    offset += RECORD_HEADER_SIZE + length;
+  }
+  return trace;
+}
+
+module.exports.createWriter = createWriter;
+module.exports.write = write;
+module.exports.flush = flush;
+module.exports.close = close;
+module.exports.read = read;
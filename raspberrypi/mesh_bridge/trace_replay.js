@@ -0,0 +1,248 @@
+// Headless replay of a PDU trace (see trace.js) through the decoding pipeline of the
+// bridge, with the keys of config.js and a mock MQTT sink: no Bluetooth adapter or
+// broker needed. Reports throughput, time per decoding stage and drops by reason.
+// Usage: node trace_replay.js <trace> [--fast] [--workers N] [--kill-worker N] [--verbose]
+//        node trace_replay.js --generate [traffic_gen.js options] [--fast] [--workers N] [--kill-worker N] [--verbose]
+//   --generate   replay synthetic traffic from traffic_gen.js instead of a trace
+//   --fast       feed notifications as fast as the decoder takes them, instead of at
+//                the pace they have been captured
+//   --workers N  decrypt in N crypto worker threads, see crypto_pool.js
+//   --kill-worker N  terminate the first crypto worker after N notifications, to check
+//                that decoding goes on (its PDUs are dropped with reason "worker")
+//   --verbose    print the decoded messages
+
+const fs = require('fs');
+const crypto = require('./crypto.js');
+const utils = require('./utils.js');
+const decoder = require('./decoder.js');
+const reassembly = require('./reassembly.js');
+const crypto_pool = require('./crypto_pool.js');
+const sensor_messages = require('./sensor_messages.js');
+const trace = require('./trace.js');
+const traffic_gen = require('./traffic_gen.js');
+const config = require('./config');
+
+const args = process.argv.slice(2);
+const generated = args.includes('--generate');
+const file = args.length > 0 && !args[0].startsWith('--') ? args[0] : null;
+const fast = args.includes('--fast');
+const verbose = args.includes('--verbose');
+const workers = args.includes('--workers') ? parseInt(args[args.indexOf('--workers') + 1]) || 0 : 0;
+const kill_after = args.includes('--kill-worker') ? parseInt(args[args.indexOf('--kill-worker') + 1]) : -1;
+if (!file && !generated) {
+  console.log("Usage: node trace_replay.js <trace> | --generate [options] [--fast] [--workers N] [--kill-worker N] [--verbose]");
+  process.exit(1);
+}
+
+// decoding time samples by stage, s
+let stage_times = new Map();
+let drops = new Map();
+let counters = {
+  notifications: 0,
+  messages: 0,
+  readings: 0,
+  unknown: 0,
+  beacons: 0
+};
+// mock MQTT sink: readings by device
+let sink = new Map();
+
+function observe(stage, seconds) {
+  if (!stage_times.has(stage)) {
+    stage_times.set(stage, []);
+  }
+  stage_times.get(stage).push(seconds);
+}
+
+function countDrop(reason) {
+  drops.set(reason, (drops.get(reason) || 0) + 1);
+}
+
+function setup() {
+  crypto.init(config.crypto_backend);
+  let hex_netkeys = [config.hex_netkey].concat(config.hex_extra_netkeys || []);
+  let hex_appkeys = [config.hex_appkey].concat(config.hex_extra_appkeys || []);
+  let hex_iv_index = config.hex_iv_index;
+  if (config.iv_index_file && fs.existsSync(config.iv_index_file)) {
+    hex_iv_index = fs.readFileSync(config.iv_index_file, 'utf8').trim();
+  }
+  decoder.setKeys(hex_netkeys, hex_appkeys);
+  decoder.setIvIndex(hex_iv_index);
+  decoder.setStageObserver(observe);
+
+  if (workers > 0) {
+    crypto_pool.init(workers, {
+      crypto_backend: config.crypto_backend,
+      keys: [hex_netkeys, hex_appkeys],
+      iv_index: hex_iv_index
+    });
+    decoder.setPool(crypto_pool);
+  }
+}
+
+// same handling as logAndValidatePdu() in mesh_bridge.js, MQTT and downlink aside
+function handle(result, started) {
+  if (result.status != decoder.DECODE_INCOMPLETE) {
+    observe("total", Number(process.hrtime.bigint() - started) / 1e9);
+  }
+
+  if (result.status == decoder.DECODE_BEACON) {
+    counters.beacons++;
+    if (result.beacon.length >= 14 && result.beacon[0] == 1) {
+      let hex_iv_index = utils.u8AToHexString(result.beacon.subarray(10, 14));
+      decoder.setIvIndex(hex_iv_index);
+      if (workers > 0) {
+        crypto_pool.setIvIndex(hex_iv_index);
+      }
+    }
+    return;
+  } else if (result.status == decoder.DECODE_DROPPED) {
+    countDrop(result.reason);
+    return;
+  } else if (result.status != decoder.DECODE_OK) {
+    return;
+  }
+
+  counters.messages++;
+  let hex_src = utils.toHex(result.src, 2).toLowerCase();
+  let decoded = sensor_messages.decode_message(hex_src, result.params, result.opcode, result.company_code);
+  if (decoded.err == "unknown message") {
+    counters.unknown++;
+    countDrop("unknown_message");
+    return;
+  }
+  let device = sensor_messages.get_name(hex_src);
+  sink.set(device, (sink.get(device) || 0) + 1);
+  counters.readings++;
+  if (verbose) {
+    log(`${device}: ${JSON.stringify(decoded)}`);
+  }
+}
+
+// the proxy SAR state of each captured link
+let link_states = new Map();
+
+function feed(record) {
+  let link = link_states.get(record.link);
+  if (link === undefined) {
+    link = reassembly.createProxyReassembly();
+    link_states.set(record.link, link);
+  }
+  counters.notifications++;
+  if (workers > 0 && counters.notifications == kill_after) {
+    crypto_pool.kill(0);
+  }
+
+  let started = process.hrtime.bigint();
+  if (workers > 0) {
+    if (crypto_pool.isSaturated()) {
+      // as the bridge does, see on_crypto_pressure()
+      countDrop("backpressure");
+      return;
+    }
+    decoder.submitProxyPdu(record.data, link, result => {
+      handle(result, started);
+      setImmediate(finish);
+    });
+  } else {
+    handle(decoder.decodeProxyPdu(record.data, link), started);
+  }
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function report(elapsed_ms) {
+  console.log(`Replayed ${counters.notifications} notifications (${span_ms.toFixed(0)} ms captured) in ` +
+    `${elapsed_ms.toFixed(0)} ms: ${(counters.notifications / (elapsed_ms / 1000)).toFixed(0)} notifications/s, ` +
+    `${workers > 0 ? workers + " crypto workers" : "inline decryption"}`);
+  console.log(`Messages: ${counters.messages} decoded, ${counters.readings} readings to MQTT ` +
+    `for ${sink.size} devices, ${counters.beacons} beacons`);
+
+  let dropped = [...drops].sort((a, b) => b[1] - a[1]);
+  let total_drops = dropped.reduce((sum, [, count]) => sum + count, 0);
+  console.log(`Drops: ${total_drops}` + (total_drops > 0 ? ` (${dropped.map(([reason, count]) => `${reason} ${count}`).join(', ')})` : ""));
+
+  console.log("Stage        count     mean      p50      p99      max (us)");
+  for (let [stage, times] of stage_times) {
+    let sorted = Float64Array.from(times).sort();
+    let mean = sorted.reduce((sum, t) => sum + t, 0) / sorted.length;
+    let us = t => (t * 1e6).toFixed(1).padStart(8);
+    console.log(`${stage.padEnd(10)} ${String(sorted.length).padStart(7)} ${us(mean)} ${us(percentile(sorted, 0.5))} ` +
+      `${us(percentile(sorted, 0.99))} ${us(sorted[sorted.length - 1])}`);
+  }
+}
+
+// replay state: captured notifications, next one to feed, hrtime of the start
+let records = [];
+let next = 0;
+let start = 0n;
+let span_ms = 0;
+let finished = false;
+const log = console.log;
+
+function run() {
+  if (fast) {
+    while (next < records.length && !(workers > 0 && crypto_pool.isSaturated())) {
+      feed(records[next++]);
+    }
+  } else {
+    // records due by now, at the captured pace
+    let now_us = Number(process.hrtime.bigint() - start) / 1000 + records[0].time;
+    while (next < records.length && records[next].time <= now_us) {
+      feed(records[next++]);
+    }
+    if (next < records.length) {
+      setTimeout(run, Math.max(0, (records[next].time - now_us) / 1000));
+    }
+  }
+  finish();
+}
+
+function finish() {
+  if (finished || next < records.length || crypto_pool.inFlight() > 0) {
+    return;
+  }
+  finished = true;
+  let elapsed_ms = Number(process.hrtime.bigint() - start) / 1e6;
+  console.log = log;
+  report(elapsed_ms);
+  crypto_pool.close();
+}
+
+function main() {
+  let captured;
+  if (generated) {
+    console.log = () => {};
+    captured = traffic_gen.generate(traffic_gen.parseArgs(args));
+    console.log = log;
+  } else {
+    captured = trace.read(file);
+  }
+  records = captured.records;
+  console.log(`${records.length} notifications ${generated ? "generated" : "captured"} on ${new Date(captured.start).toISOString()}`);
+  if (records.length == 0) {
+    return;
+  }
+  span_ms = (records[records.length - 1].time - records[0].time) / 1000;
+
+  // quiet the decoder setup and the malformed message logs
+  console.log = () => {};
+  setup();
+  if (workers > 0) {
+    crypto_pool.setPressureHandler(saturated => {
+      if (!saturated && fast) {
+        setImmediate(run);
+      }
+    });
+  }
+
+  // let the workers load before starting the clock
+  setTimeout(() => {
+    start = process.hrtime.bigint();
+    run();
+  }, workers > 0 ? 500 : 0);
+}
+
+main();
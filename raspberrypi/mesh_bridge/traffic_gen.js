@@ -0,0 +1,264 @@
+// Synthetic mesh traffic for load testing: the proxy PDUs a fleet of sensors would
+// produce, encrypted and obfuscated with the keys of config.js through crypto.js, as
+// GATT notifications with their time. THP sensors publish in two lower transport
+// segments (one unsegmented message with --compact 1), gas sensors in one unsegmented
+// message, both to FFFF like things/sensor.
+// With hex_extra_netkeys and hex_extra_appkeys in config.js the sensors are spread over
+// the subnets and application keys.
+// The notifications go to a PDU trace (see trace.js), or straight into the decoder
+// with trace_replay.js --generate.
+// Usage: node traffic_gen.js --out <trace> [options]
+//   --sources N        sensors, from address 0x0100 (default 10)
+//   --thp-ratio R      share of THP sensors, the others publish gas readings (0.5)
+//   --thp-period S     --gas-period S, publish periods in s (60, 60)
+//   --compact 1        THP sensors publish the compact vendor status (0)
+//   --duration S       traffic length in s (600)
+//   --speedup X        publish X times faster than the periods say (1)
+//   --retransmit N     network retransmissions of each PDU, 10 ms apart (0)
+//   --links N          proxies relaying every PDU to the bridge, a link each (1)
+//   --mtu N            ATT MTU of the links, PDUs longer than MTU - 3 use proxy SAR (23)
+//   --corrupt P        probability of a flipped byte in a notification (0)
+//   --seed N           random seed, same seed same traffic (1)
+
+const fs = require('fs');
+const crypto = require('./crypto.js');
+const utils = require('./utils.js');
+const trace = require('./trace.js');
+const sensor_messages = require('./sensor_messages.js');
+const config = require('./config');
+
+const FIRST_ADDRESS = 0x0100;
+const PUBLISH_ADDRESS = "ffff";
+// TTL of the sensors publications, see things/sensor
+const TTL = 5;
+// network transmit interval - ref 4.2.19
+const RETRANSMIT_INTERVAL = 10000;
+// time between the segments of a message, and between a PDU and its copy on the next link, us
+const SEGMENT_INTERVAL = 20000;
+const LINK_DELAY = 3000;
+const ATT_HEADER_SIZE = 3;
+
+// Sensor Status opcode, property IDs and the compact status are those of sensor_messages.js
+const OPCODE_SENSOR_STATUS = 0x52;
+
+const DEFAULTS = {
+  sources: 10,
+  thp_ratio: 0.5,
+  thp_period: 60,
+  gas_period: 60,
+  compact: 0,
+  duration: 600,
+  speedup: 1,
+  retransmit: 0,
+  links: 1,
+  mtu: 23,
+  corrupt: 0,
+  seed: 1
+};
+
+// options from the command line, e.g. --thp-period 30 sets thp_period
+function parseArgs(args) {
+  let options = Object.assign({}, DEFAULTS);
+  for (let i = 0; i < args.length - 1; i++) {
+    let name = args[i].startsWith('--') ? args[i].substring(2).replace(/-/g, '_') : null;
+    if (name in DEFAULTS) {
+      options[name] = parseFloat(args[++i]);
+    }
+  }
+  return options;
+}
+
+// small seeded PRNG (mulberry32), so that runs can be compared
+function createRandom(seed) {
+  let state = seed >>> 0;
+  return () => {
+    state = (state + 0x6D2B79F5) >>> 0;
+    let t = state;
+    t = Math.imul(t ^ (t >>> 15), t | 1);
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  };
+}
+
+// keys of config.js: hex keys as the decoder takes them, and the material to encrypt with
+function keys() {
+  crypto.init(config.crypto_backend);
+  let hex_netkeys = [config.hex_netkey].concat(config.hex_extra_netkeys || []);
+  let hex_appkeys = [config.hex_appkey].concat(config.hex_extra_appkeys || []);
+  let hex_iv_index = config.hex_iv_index;
+  if (config.iv_index_file && fs.existsSync(config.iv_index_file)) {
+    hex_iv_index = fs.readFileSync(config.iv_index_file, 'utf8').trim();
+  }
+  return {
+    hex_netkeys: hex_netkeys,
+    hex_appkeys: hex_appkeys,
+    subnets: hex_netkeys.map(hex_netkey => {
+      let k2_material = crypto.k2(hex_netkey, "00");
+      return {
+        encryption_key: k2_material.encryption_key,
+        privacy_key: k2_material.privacy_key,
+        nid: parseInt(k2_material.NID, 16)
+      };
+    }),
+    appkeys: hex_appkeys.map(hex_appkey => ({ hex_appkey: hex_appkey, aid: parseInt(crypto.k4(hex_appkey), 16) })),
+    hex_iv_index: hex_iv_index
+  };
+}
+
+// network PDU from src - ref 3.4.4
+function networkPdu(keys, subnet, src, seq, hex_lower_transport_pdu) {
+  let hex_seq = utils.toHex(seq, 3);
+  let hex_src = utils.toHex(src, 2);
+  let hex_nonce = "00" + utils.intToHex(TTL) + hex_seq + hex_src + "0000" + keys.hex_iv_index;
+  let enc = crypto.meshAuthEncNetwork(subnet.encryption_key, hex_nonce, PUBLISH_ADDRESS, hex_lower_transport_pdu, 4);
+  let obfuscated = crypto.obfuscate(enc.EncDST, enc.EncTransportPDU, enc.NetMIC, "00", utils.intToHex(TTL),
+    hex_seq, hex_src, keys.hex_iv_index, subnet.privacy_key);
+  let ivi_nid = ((parseInt(keys.hex_iv_index, 16) & 1) << 7) | subnet.nid;
+  return Buffer.from(utils.intToHex(ivi_nid) + obfuscated.obfuscated_ctl_ttl_seq_src +
+    enc.EncDST + enc.EncTransportPDU + enc.NetMIC, 'hex');
+}
+
+// Sensor Status access payload, values as read_thp() and the gas sensor would produce them
+function accessPayload(thp, compact, random) {
+  if (thp && compact) {
+    let payload = Buffer.alloc(10);
+    // vendor opcode: 3 bytes, the company ID little endian
+    payload[0] = sensor_messages.OPCODE_THP_COMPACT_STATUS;
+    payload.writeUInt16LE(sensor_messages.COMPANY_ID, 1);
+    payload[3] = sensor_messages.THP_COMPACT_LAYOUT_V1;
+    payload.writeInt16LE(1800 + Math.floor(random() * 800), 4);
+    payload.writeUInt16LE(3000 + Math.floor(random() * 3000), 6);
+    payload.writeUInt16LE(10000 + Math.floor(random() * 300), 8);
+    return payload.toString('hex');
+  }
+
+  let payload = Buffer.alloc(thp ? 13 : 5);
+  payload[0] = OPCODE_SENSOR_STATUS;
+  if (thp) {
+    payload.writeUInt16LE(sensor_messages.ID_TEMP_CELSIUS, 1);
+    payload.writeUInt16LE(1800 + Math.floor(random() * 800), 3);
+    payload.writeUInt16LE(sensor_messages.ID_HUMIDITY, 5);
+    payload.writeUInt16LE(3000 + Math.floor(random() * 3000), 7);
+    payload.writeUInt16LE(sensor_messages.ID_PRESSURE, 9);
+    payload.writeUInt16LE(10000 + Math.floor(random() * 300), 11);
+  } else {
+    payload.writeUInt16LE(sensor_messages.ID_GAS, 1);
+    payload.writeUInt16LE(400 + Math.floor(random() * 1600), 3);
+  }
+  return payload.toString('hex');
+}
+
+// network PDUs of a message, one per lower transport segment - ref 3.5.2
+function messagePdus(keys, subnet, app, src, seq, thp, compact, random) {
+  let hex_app_nonce = "0100" + utils.toHex(seq, 3) + utils.toHex(src, 2) + PUBLISH_ADDRESS + keys.hex_iv_index;
+  let enc = crypto.meshAuthEncAccessPayload(app.hex_appkey, hex_app_nonce, accessPayload(thp, compact, random), 4);
+  let upper_transport_pdu = Buffer.from(enc.EncAccessPayload + enc.TransMIC, 'hex');
+  if (upper_transport_pdu.length <= 15) {
+    return [networkPdu(keys, subnet, src, seq, utils.intToHex(0x40 | app.aid) + upper_transport_pdu.toString('hex'))];
+  }
+
+  let pdus = [];
+  let seg_n = Math.ceil(upper_transport_pdu.length / 12) - 1;
+  for (let seg_o = 0; seg_o <= seg_n; seg_o++) {
+    let header = Buffer.alloc(4);
+    header[0] = 0xC0 | app.aid;
+    header.writeUIntBE(((seq & 0x1FFF) << 10) | (seg_o << 5) | seg_n, 1, 3);
+    let data = upper_transport_pdu.subarray(seg_o * 12, (seg_o + 1) * 12);
+    pdus.push(networkPdu(keys, subnet, src, seq + seg_o, header.toString('hex') + data.toString('hex')));
+  }
+  return pdus;
+}
+
+// GATT notifications of a network PDU, split with proxy SAR if needed - ref 6.3.1
+function notifications(network_pdu, mtu) {
+  let size = mtu - ATT_HEADER_SIZE;
+  if (network_pdu.length + 1 <= size) {
+    return [Buffer.concat([Buffer.from([0x00]), network_pdu])];
+  }
+  let segments = [];
+  for (let offset = 0; offset < network_pdu.length; offset += size - 1) {
+    let sar = offset == 0 ? 0x40 : (offset + size - 1 >= network_pdu.length ? 0xC0 : 0x80);
+    segments.push(Buffer.concat([Buffer.from([sar]), network_pdu.subarray(offset, offset + size - 1)]));
+  }
+  return segments;
+}
+
+// traffic as a trace: {start, records: [{time, link, data}]}, sorted by time in us, and counters
+function generate(options) {
+  let random = createRandom(options.seed);
+  let mesh_keys = keys();
+  let duration = options.duration * 1e6;
+  let records = [];
+  let stats = { messages: 0, network_pdus: 0, corrupted: 0 };
+
+  for (let i = 0; i < options.sources; i++) {
+    let src = FIRST_ADDRESS + i;
+    let thp = i < Math.round(options.sources * options.thp_ratio);
+    let period = (thp ? options.thp_period : options.gas_period) * 1e6 / options.speedup;
+    let subnet = mesh_keys.subnets[i % mesh_keys.subnets.length];
+    let app = mesh_keys.appkeys[i % mesh_keys.appkeys.length];
+    let seq = 1;
+
+    // sensors are switched on at random times
+    for (let time = random() * period; time < duration; time += period) {
+      let pdus = messagePdus(mesh_keys, subnet, app, src, seq, thp, options.compact > 0, random);
+      seq += pdus.length;
+      stats.messages++;
+
+      pdus.forEach((network_pdu, segment) => {
+        for (let copy = 0; copy <= options.retransmit; copy++) {
+          stats.network_pdus++;
+          for (let link = 0; link < options.links; link++) {
+            let at = Math.round(time + segment * SEGMENT_INTERVAL + copy * RETRANSMIT_INTERVAL + link * LINK_DELAY);
+            for (let data of notifications(network_pdu, options.mtu)) {
+              if (random() < options.corrupt) {
+                data = Buffer.from(data);
+                data[Math.floor(random() * data.length)] ^= 1 << Math.floor(random() * 8);
+                stats.corrupted++;
+              }
+              records.push({ time: at, link: "proxy" + link, data: Uint8Array.from(data) });
+            }
+          }
+        }
+      });
+    }
+  }
+
+  // stable sort: the notifications of a proxy PDU stay in order
+  records.sort((a, b) => a.time - b.time);
+  return { start: Date.now(), records: records, stats: stats };
+}
+
+function main() {
+  let args = process.argv.slice(2);
+  let out = args.includes('--out') ? args[args.indexOf('--out') + 1] : null;
+  if (!out) {
+    console.log("Usage: node traffic_gen.js --out <trace> [options], see traffic_gen.js");
+    process.exit(1);
+  }
+  let options = parseArgs(args);
+
+  const log = console.log;
+  console.log = () => {};
+  let traffic = generate(options);
+  console.log = log;
+
+  let writer = trace.createWriter(out);
+  for (let record of traffic.records) {
+    trace.write(writer, record.link, record.data, record.time);
+  }
+  trace.close(writer);
+
+  let seconds = options.duration;
+  console.log(`${options.sources} sensors, ${traffic.stats.messages} messages, ${traffic.stats.network_pdus} network PDUs, ` +
+    `${traffic.records.length} notifications (${(traffic.records.length / seconds).toFixed(1)}/s over ${seconds} s), ` +
+    `${traffic.stats.corrupted} corrupted, written to ${out}`);
+}
+
+if (require.main === module) {
+  main();
+}
+
+module.exports.parseArgs = parseArgs;
+module.exports.generate = generate;
+module.exports.keys = keys;
@@ -2,7 +2,8 @@
  * Sensor client model.
  * The model can query the status of generic onoff server models and receive status updates.
  * This model supports THP and gas status messages.
- * Include SENSOR_CLIENT_MODEL in an element.
+ * Include SENSOR_CLIENT_MODEL in an element, and SENSOR_CLIENT_VND_MODEL among the vendor models of the same
+ * element to receive the compact THP status (see things/sensor thp_sensor.h).
  * The model publication context can be auto-configured with sensor_cli_autoconf().
  */
 
@@ -37,10 +38,38 @@ void sensor_cli_set_gas_callback(gas_data_cb cb) {
 #define ID_PRESSURE		0x2A12
 #define ID_GAS 0x2A13
 
+/* Compact THP status: layout tag, temperature, humidity and pressure in a single unsegmented PDU */
+#define SENSOR_CLI_COMPANY_ID 0xFFFF
+#define SENSOR_CLI_VND_MODEL_ID 0x0001
+#define BT_MESH_MODEL_OP_THP_COMPACT_STATUS BT_MESH_MODEL_OP_3(0x01, SENSOR_CLI_COMPANY_ID)
+#define THP_COMPACT_LAYOUT_V1 0x01
+
 /* Sensor publication context used to send status-get messages */
 BT_MESH_MODEL_PUB_DEFINE(sensor_cli_pub, NULL, 0); // Property ID not supported
 
-/* Handle sensor status messages. Messages can either be THP messages (12 bytes) or gas messages (4 bytes) */
+/* Marshalled THP Sensor Data replied to a Sensor Get: three Format B property IDs (3 bytes) and 16-bit values */
+#define THP_MARSHALLED_LEN (3 * (3 + 2))
+
+/**
+ * Pulls a Format B Marshalled Property ID with a 2 bytes value, as the THP sensor replies them.
+ * @return the value, -1 if the header isn't the expected one.
+ */
+static int32_t sensor_cli_pull_marshalled(struct net_buf_simple *buf, uint16_t property_id) {
+	uint8_t header = net_buf_simple_pull_u8(buf);
+	uint16_t id = net_buf_simple_pull_le16(buf);
+	uint16_t value = net_buf_simple_pull_le16(buf);
+
+	// Format B (bit 0 set), length - 1 in the next 7 bits
+	if (header != (((2 - 1) << 1) | 0x01) || id != property_id) {
+		return -1;
+	}
+	return value;
+}
+
+/**
+ * Handle sensor status messages. Messages can either be THP publications (12 bytes), THP replies to a Sensor Get
+ * in marshalled Sensor Data (15 bytes) or gas messages (4 bytes)
+ */
 static void sensor_cli_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
 	printk("sensor_cli_status - buf len:%d\n",  buf->len);
 
@@ -99,19 +128,70 @@ static void sensor_cli_status(struct bt_mesh_model *model, struct bt_mesh_msg_ct
             printk("Please set thp callback\n");
         }
         
+    } else if (buf->len == THP_MARSHALLED_LEN) {
+
+        int32_t temperature = sensor_cli_pull_marshalled(buf, ID_TEMP_CELSIUS);
+        int32_t humidity = sensor_cli_pull_marshalled(buf, ID_HUMIDITY);
+        int32_t pressure = sensor_cli_pull_marshalled(buf, ID_PRESSURE);
+        if (temperature < 0 || humidity < 0 || pressure < 0) {
+            printk("Ignoring THP sensor status message: unrecognized marshalled sensor data\n");
+            return;
+        }
+
+        printf("\nSensor Get reply: temp %.2f, hum %.2f, press %.2f\n", ((float) (int16_t) temperature) / 100,
+            ((float) humidity) / 100, ((float) pressure) / 100);
+
+        if (thp_callback != NULL) {
+            thp_callback(((float) (int16_t) temperature) / 100, ((float) humidity) / 100, ((float) pressure) / 100,
+                ctx->addr);
+        } else {
+            printk("Please set thp callback\n");
+        }
+
     } else {
         printk("ignoring sensor_status message: unrecognized len\n");
         return;
     }
 }
 
+/* Handle compact THP status messages: layout tag (1 byte) and three 16-bit values (6 bytes) */
+static void sensor_cli_thp_compact_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	printk("sensor_cli_thp_compact_status - buf len:%d\n", buf->len);
+
+	uint8_t layout = net_buf_simple_pull_u8(buf);
+	if (layout != THP_COMPACT_LAYOUT_V1) {
+		printk("Ignoring compact THP status message: unrecognized layout 0x%02x\n", layout);
+		return;
+	}
+
+	// Values are multiplied by 100, temperature is signed
+	float temperature = ((float) (int16_t) net_buf_simple_pull_le16(buf)) / 100;
+	float humidity = ((float) net_buf_simple_pull_le16(buf)) / 100;
+	float pressure = ((float) net_buf_simple_pull_le16(buf)) / 100;
+
+	printf("\nCompact THP status: temp %.2f, hum %.2f, press %.2f\n", temperature, humidity, pressure);
+
+	if (thp_callback != NULL) {
+		thp_callback(temperature, humidity, pressure, ctx->addr);
+	} else {
+		printk("Please set thp callback\n");
+	}
+}
+
 /* Opcodes supported by this model */
 static const struct bt_mesh_model_op sensor_cli_op[] = {
 	{ BT_MESH_MODEL_OP_SENSOR_STATUS, 4, sensor_cli_status },
 	BT_MESH_MODEL_OP_END,
 };
 
+/* Vendor opcodes, handled by a vendor model since the mesh stack looks them up among the vendor models */
+static const struct bt_mesh_model_op sensor_cli_vnd_op[] = {
+	{ BT_MESH_MODEL_OP_THP_COMPACT_STATUS, 1+2+2+2, sensor_cli_thp_compact_status },
+	BT_MESH_MODEL_OP_END,
+};
+
 #define SENSOR_CLIENT_MODEL BT_MESH_MODEL(BT_MESH_MODEL_ID_SENSOR_CLI, sensor_cli_op, &sensor_cli_pub, NULL)
+#define SENSOR_CLIENT_VND_MODEL BT_MESH_MODEL_VND(SENSOR_CLI_COMPANY_ID, SENSOR_CLI_VND_MODEL_ID, sensor_cli_vnd_op, NULL, NULL)
 
 /* Sensor client get message used to requests sensors status */
 void sensor_cli_get(struct bt_mesh_model *model) {
@@ -147,6 +227,12 @@ int sensor_cli_autoconf(uint16_t root_addr, uint16_t elem_addr) {
 		return err;
 	}
 
+	err = bt_mesh_cfg_mod_app_bind_vnd(0, root_addr, elem_addr, 0, SENSOR_CLI_VND_MODEL_ID, SENSOR_CLI_COMPANY_ID, NULL);
+	if (err) {
+		printk("Error binding default app key to sensor client vendor model\n");
+		return err;
+	}
+
 	struct bt_mesh_cfg_mod_pub pub_sens_cli = {
 		.addr = 0xFFFF,
 		.app_idx = 0,
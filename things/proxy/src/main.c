@@ -119,9 +119,14 @@ static struct bt_mesh_model sig_models[] = {
 	SENSOR_CLIENT_MODEL,
 };
 
+// receives the compact THP status
+static struct bt_mesh_model vnd_models[] = {
+	SENSOR_CLIENT_VND_MODEL,
+};
+
 // define the element(s) which contain the previously defined models
 static struct bt_mesh_elem elements[] = {
-	BT_MESH_ELEM(0, sig_models, BT_MESH_MODEL_NONE), // .._MODEL_NONE means no vendor models
+	BT_MESH_ELEM(0, sig_models, vnd_models),
 };
 
 // define the node containing the elements (composition)
@@ -0,0 +1,122 @@
+/**
+ * Sensor Cadence state of a sensor property (mesh model specification, section 4.1.3): the publish period is
+ * divided by 2^fast_period_divisor while the value is in the fast cadence range, and a status is published as
+ * soon as the value moves by more than delta_up / delta_down from the last published one, but not more often
+ * than every 2^min_interval ms.
+ * Values are in the published unit, i.e. sensor readings multiplied by 100 and sent as 16-bit integers.
+ * The sensor server model samples its sensors and calls sensor_cadence_fast() and sensor_cadence_triggered()
+ * to decide when to publish, then sensor_cadence_published() with the published value.
+ */
+
+#ifndef SENSOR_CADENCE_H
+#define SENSOR_CADENCE_H
+
+#include <zephyr.h>
+#include <stdbool.h>
+#include <bluetooth/mesh.h>
+
+/* Status trigger type: deltas in value units, or in 0.01 % of the last published value */
+#define SENSOR_CADENCE_TRIGGER_VALUE 0
+#define SENSOR_CADENCE_TRIGGER_PERCENT 1
+
+#define SENSOR_CADENCE_DIVISOR_MAX 15
+#define SENSOR_CADENCE_MIN_INTERVAL_MAX 26
+
+/* Cadence state fields after the property ID: divisor and trigger type (1), deltas (2+2), min interval (1),
+ * fast cadence low and high (2+2) */
+#define SENSOR_CADENCE_STATE_LEN (1+2+2+1+2+2)
+
+struct sensor_cadence {
+	uint16_t property_id;
+	uint8_t fast_period_divisor;
+	uint8_t trigger_type;
+	/* a delta of 0 disables the trigger */
+	uint16_t delta_down;
+	uint16_t delta_up;
+	uint8_t min_interval;
+	/* fast cadence when low <= value <= high, or when value < high or value > low if high < low */
+	int16_t fast_low;
+	int16_t fast_high;
+
+	/* last published value and its uptime in ms, valid once published is set */
+	int32_t last_value;
+	int64_t last_time;
+	bool published;
+};
+
+bool sensor_cadence_fast(const struct sensor_cadence *cadence, int32_t value) {
+	if (cadence->fast_period_divisor == 0) {
+		return false;
+	}
+	if (cadence->fast_high >= cadence->fast_low) {
+		return value >= cadence->fast_low && value <= cadence->fast_high;
+	}
+	return value < cadence->fast_high || value > cadence->fast_low;
+}
+
+/* True if the value moved enough since the last publication and the min interval has elapsed */
+bool sensor_cadence_triggered(const struct sensor_cadence *cadence, int32_t value) {
+	if (!cadence->published) {
+		return true;
+	}
+	if (k_uptime_get() - cadence->last_time < (1LL << cadence->min_interval)) {
+		return false;
+	}
+
+	int32_t delta_up = cadence->delta_up;
+	int32_t delta_down = cadence->delta_down;
+	if (cadence->trigger_type == SENSOR_CADENCE_TRIGGER_PERCENT) {
+		int32_t base = cadence->last_value < 0 ? -cadence->last_value : cadence->last_value;
+		delta_up = (int32_t) (((int64_t) base * delta_up) / 10000);
+		delta_down = (int32_t) (((int64_t) base * delta_down) / 10000);
+	}
+
+	return (cadence->delta_up > 0 && value - cadence->last_value > delta_up)
+		|| (cadence->delta_down > 0 && cadence->last_value - value > delta_down);
+}
+
+void sensor_cadence_published(struct sensor_cadence *cadence, int32_t value) {
+	cadence->last_value = value;
+	cadence->last_time = k_uptime_get();
+	cadence->published = true;
+}
+
+/* Appends the Sensor Cadence Status fields, property ID included */
+void sensor_cadence_add(struct net_buf_simple *msg, const struct sensor_cadence *cadence) {
+	net_buf_simple_add_le16(msg, cadence->property_id);
+	net_buf_simple_add_u8(msg, (cadence->fast_period_divisor & 0x7F) | (cadence->trigger_type << 7));
+	net_buf_simple_add_le16(msg, cadence->delta_down);
+	net_buf_simple_add_le16(msg, cadence->delta_up);
+	net_buf_simple_add_u8(msg, cadence->min_interval);
+	net_buf_simple_add_le16(msg, (uint16_t) cadence->fast_low);
+	net_buf_simple_add_le16(msg, (uint16_t) cadence->fast_high);
+}
+
+/**
+ * Sets the cadence from the fields of a Sensor Cadence Set message that follow the property ID.
+ * @return 0 on success, -EINVAL if the message is malformed or has prohibited values: the state is unchanged.
+ */
+int sensor_cadence_pull(struct sensor_cadence *cadence, struct net_buf_simple *buf) {
+	if (buf->len != SENSOR_CADENCE_STATE_LEN) {
+		return -EINVAL;
+	}
+
+	uint8_t divisor_and_type = net_buf_simple_pull_u8(buf);
+	uint16_t delta_down = net_buf_simple_pull_le16(buf);
+	uint16_t delta_up = net_buf_simple_pull_le16(buf);
+	uint8_t min_interval = net_buf_simple_pull_u8(buf);
+	if ((divisor_and_type & 0x7F) > SENSOR_CADENCE_DIVISOR_MAX || min_interval > SENSOR_CADENCE_MIN_INTERVAL_MAX) {
+		return -EINVAL;
+	}
+
+	cadence->fast_period_divisor = divisor_and_type & 0x7F;
+	cadence->trigger_type = divisor_and_type >> 7;
+	cadence->delta_down = delta_down;
+	cadence->delta_up = delta_up;
+	cadence->min_interval = min_interval;
+	cadence->fast_low = (int16_t) net_buf_simple_pull_le16(buf);
+	cadence->fast_high = (int16_t) net_buf_simple_pull_le16(buf);
+	return 0;
+}
+
+#endif //SENSOR_CADENCE_H
@@ -0,0 +1,40 @@
+/**
+ * Marshalling of the Sensor Data carried by Sensor Status messages (mesh model specification, section 4.2.14):
+ * each property value is preceded by a Marshalled Property ID, in Format A (2 bytes) for property IDs below
+ * 0x0800 and values of 1 to 16 bytes, in Format B (3 bytes) otherwise.
+ */
+
+#ifndef SENSOR_DATA_H
+#define SENSOR_DATA_H
+
+#include <bluetooth/mesh.h>
+
+#define SENSOR_DATA_FORMAT_A 0x00
+#define SENSOR_DATA_FORMAT_B 0x01
+/* Format B length of a property the sensor doesn't have */
+#define SENSOR_DATA_LENGTH_ZERO 0x7F
+
+#define SENSOR_DATA_FORMAT_A_MAX_ID 0x07FF
+#define SENSOR_DATA_FORMAT_A_MAX_LEN 16
+
+/* Largest Marshalled Property ID */
+#define SENSOR_DATA_HEADER_MAX_LEN 3
+
+/* Appends the Marshalled Property ID and the value of a property */
+void sensor_data_add(struct net_buf_simple *msg, uint16_t property_id, const uint8_t *value, uint8_t len) {
+	if (property_id <= SENSOR_DATA_FORMAT_A_MAX_ID && len > 0 && len <= SENSOR_DATA_FORMAT_A_MAX_LEN) {
+		net_buf_simple_add_le16(msg, (property_id << 5) | ((len - 1) << 1) | SENSOR_DATA_FORMAT_A);
+	} else {
+		net_buf_simple_add_u8(msg, ((len - 1) << 1) | SENSOR_DATA_FORMAT_B);
+		net_buf_simple_add_le16(msg, property_id);
+	}
+	net_buf_simple_add_mem(msg, value, len);
+}
+
+/* Appends a property the sensor doesn't have: a Format B Marshalled Property ID with zero length */
+void sensor_data_add_unknown(struct net_buf_simple *msg, uint16_t property_id) {
+	net_buf_simple_add_u8(msg, (SENSOR_DATA_LENGTH_ZERO << 1) | SENSOR_DATA_FORMAT_B);
+	net_buf_simple_add_le16(msg, property_id);
+}
+
+#endif //SENSOR_DATA_H
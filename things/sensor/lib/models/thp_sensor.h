@@ -3,12 +3,27 @@
  * The model will periodically publish status messages. The publishing cadence can be set after 
  * provisioning e.g. with the nRF Mesh application.
  * Sensor statuses can also be published using thp_sensor_publish_data.
+ * A Sensor Get is answered with the readings as marshalled Sensor Data (see sensor_data.h), only the requested
+ * property with a Property ID; publications keep the unmarshalled layout the proxy and the bridge decode.
+ * Descriptor, Column and Series Gets are answered too, the THP properties having no series.
  * Include THP_SENSOR_MODEL in an element and setup the model with thp_sensor_setup().
  * The model publication context can be auto-configured with thp_sensor_autoconf().
  * 
  * Important note: sensor readings are published after being multiplied by 100. The reason is that
  * we had errors when trying to append 32-bit values to a net_buf_simple, and we didn't want to lose
  * the decimal part of the sensor reading.
+ *
+ * With THP_SENSOR_COMPACT_STATUS set to 1 the readings are published with the compact THP status, a
+ * vendor message of 10 bytes instead of the 13 bytes Sensor Status: it fits in a single unsegmented
+ * PDU (at most 11 bytes of access payload) while the Sensor Status needs two segments. Receivers must
+ * support it, see the proxy sensor client and the Raspberry Pi bridge.
+ *
+ * The sensors are sampled on a work queue of their own, every THP_SENSOR_SAMPLE_PERIOD seconds and right before
+ * each periodic publication, into a double-buffered snapshot: publications and Sensor Gets only copy the latest
+ * values and never wait for the I2C sensors. After each sample the Sensor Cadence state of each property (see
+ * sensor_cadence.h) is applied: a status is published as soon as a reading moves past its delta triggers, and
+ * the publish period is divided while a reading is in its fast cadence range. Include THP_SENSOR_SETUP_MODEL
+ * next to THP_SENSOR_MODEL to get and set the cadence with Sensor Cadence messages.
  */
 
 #ifndef THP_SENSOR_H
@@ -16,14 +31,141 @@
 
 #include <bluetooth/mesh.h>
 #include "../sensors/thp_reader.h"
+#include "sensor_cadence.h"
+#include "sensor_data.h"
 
+#define BT_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET	BT_MESH_MODEL_OP_2(0x82, 0x30)
+#define BT_MESH_MODEL_OP_SENSOR_DESCRIPTOR_STATUS	BT_MESH_MODEL_OP_1(0x51)
 #define BT_MESH_MODEL_OP_SENSOR_STATUS	BT_MESH_MODEL_OP_1(0x52)
 #define BT_MESH_MODEL_OP_SENSOR_GET	BT_MESH_MODEL_OP_2(0x82, 0x31)
+#define BT_MESH_MODEL_OP_SENSOR_COLUMN_GET	BT_MESH_MODEL_OP_2(0x82, 0x32)
+#define BT_MESH_MODEL_OP_SENSOR_COLUMN_STATUS	BT_MESH_MODEL_OP_1(0x53)
+#define BT_MESH_MODEL_OP_SENSOR_SERIES_GET	BT_MESH_MODEL_OP_2(0x82, 0x33)
+#define BT_MESH_MODEL_OP_SENSOR_SERIES_STATUS	BT_MESH_MODEL_OP_1(0x54)
+#define BT_MESH_MODEL_OP_SENSOR_CADENCE_GET	BT_MESH_MODEL_OP_2(0x82, 0x34)
+#define BT_MESH_MODEL_OP_SENSOR_CADENCE_SET	BT_MESH_MODEL_OP_1(0x55)
+#define BT_MESH_MODEL_OP_SENSOR_CADENCE_SET_UNACK	BT_MESH_MODEL_OP_1(0x56)
+#define BT_MESH_MODEL_OP_SENSOR_CADENCE_STATUS	BT_MESH_MODEL_OP_1(0x57)
 
 #define ID_TEMP_CELSIUS 0x2A10
 #define ID_HUMIDITY		0x2A11
 #define ID_PRESSURE		0x2A12
 
+#ifndef THP_SENSOR_COMPACT_STATUS
+#define THP_SENSOR_COMPACT_STATUS 0
+#endif
+
+/* Test company ID, as in the node composition */
+#define THP_COMPANY_ID 0xFFFF
+/**
+ * Compact THP status: layout tag (1 byte), temperature (signed, 0.01 degC), humidity (0.01 %) and
+ * pressure (0.01 kPa), 16-bit little endian values.
+ */
+#define BT_MESH_MODEL_OP_THP_COMPACT_STATUS BT_MESH_MODEL_OP_3(0x01, THP_COMPANY_ID)
+#define THP_COMPACT_LAYOUT_V1 0x01
+
+/* Sensor Status with 3 property IDs and values, the longest of the two messages */
+#define THP_STATUS_LEN (1+2+2+2+2+2+2)
+
+#ifndef THP_SENSOR_SAMPLE_PERIOD
+#define THP_SENSOR_SAMPLE_PERIOD 15
+#endif
+
+/**
+ * Default cadence, in published units (readings multiplied by 100): statuses on a change of 0.5 degC, 2 % of
+ * humidity or 0.1 kPa, at most every 4 s (2^12 ms), and 4 times more often below 10 degC or above 30 degC.
+ */
+struct sensor_cadence thp_cadence[] = {
+	{ .property_id = ID_TEMP_CELSIUS, .fast_period_divisor = 2, .trigger_type = SENSOR_CADENCE_TRIGGER_VALUE,
+	  .delta_down = 50, .delta_up = 50, .min_interval = 12, .fast_low = 3000, .fast_high = 1000 },
+	{ .property_id = ID_HUMIDITY, .fast_period_divisor = 0, .trigger_type = SENSOR_CADENCE_TRIGGER_VALUE,
+	  .delta_down = 200, .delta_up = 200, .min_interval = 12, .fast_low = 0, .fast_high = 0 },
+	{ .property_id = ID_PRESSURE, .fast_period_divisor = 0, .trigger_type = SENSOR_CADENCE_TRIGGER_VALUE,
+	  .delta_down = 10, .delta_up = 10, .min_interval = 12, .fast_low = 0, .fast_high = 0 },
+};
+
+/* Sampling work queue: preemptible, below the Bluetooth and system work queue threads */
+#define THP_SAMPLE_STACK_SIZE 1536
+#define THP_SAMPLE_PRIORITY 10
+
+/*
+ * Time (ms) the sensors take to convert: the sampling for a publication starts this early, plus the duration
+ * of the last sample
+ */
+#ifndef THP_SENSOR_CONVERSION_TIME
+#define THP_SENSOR_CONVERSION_TIME 50
+#endif
+
+K_THREAD_STACK_DEFINE(thp_sample_stack, THP_SAMPLE_STACK_SIZE);
+struct k_work_q thp_sample_queue;
+struct k_delayed_work thp_sample_work;
+/* Applies the cadence to a new sample, on the system work queue like the periodic publication */
+struct k_work thp_cadence_work;
+int32_t thp_sample_duration = 0;
+
+struct thp_snapshot {
+	float temperature;
+	float humidity;
+	float pressure;
+	int64_t time;
+	bool valid;
+};
+
+/* The sampler fills the buffer that isn't ready, then makes it the ready one */
+struct thp_snapshot thp_snapshots[2];
+atomic_t thp_snapshot_ready = ATOMIC_INIT(0);
+
+/* Copies the latest snapshot, returns -1 if the sensors haven't been sampled yet */
+static int thp_snapshot_get(struct thp_snapshot *snapshot) {
+	*snapshot = thp_snapshots[atomic_get(&thp_snapshot_ready)];
+	return snapshot->valid ? 0 : -1;
+}
+
+static struct sensor_cadence *thp_cadence_get(uint16_t property_id) {
+	for (int i = 0; i < ARRAY_SIZE(thp_cadence); i++) {
+		if (thp_cadence[i].property_id == property_id) {
+			return &thp_cadence[i];
+		}
+	}
+	return NULL;
+}
+
+/* Readings as published: multiplied by 100, in the order of thp_cadence */
+static void thp_published_values(int32_t values[3], float temperature, float humidity, float pressure) {
+	values[0] = (int16_t) (temperature * 100);
+	values[1] = (uint16_t) (humidity * 100);
+	values[2] = (int16_t) (pressure * 100);
+}
+
+/* Fills msg with a THP status message, in the format selected by THP_SENSOR_COMPACT_STATUS */
+static void thp_sensor_msg_init(struct net_buf_simple *msg, float temperature, float humidity, float pressure) {
+	int32_t values[3];
+
+	// the message is about to be published: the cadence triggers are relative to these values
+	thp_published_values(values, temperature, humidity, pressure);
+	for (int i = 0; i < ARRAY_SIZE(thp_cadence); i++) {
+		sensor_cadence_published(&thp_cadence[i], values[i]);
+	}
+
+	// Sensor values are sent as 16-bit integers due to errors when sending 32-bit values with zephyr net_buf_simple
+	if (THP_SENSOR_COMPACT_STATUS) {
+		bt_mesh_model_msg_init(msg, BT_MESH_MODEL_OP_THP_COMPACT_STATUS);
+		net_buf_simple_add_u8(msg, THP_COMPACT_LAYOUT_V1);
+		net_buf_simple_add_le16(msg, (int16_t) (temperature * 100));
+		net_buf_simple_add_le16(msg, (uint16_t) (humidity * 100));
+		net_buf_simple_add_le16(msg, (uint16_t) (pressure * 100));
+		return;
+	}
+
+	bt_mesh_model_msg_init(msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
+	net_buf_simple_add_le16(msg, ID_TEMP_CELSIUS);
+	net_buf_simple_add_le16(msg, (int16_t) (temperature * 100)); 
+	net_buf_simple_add_le16(msg, ID_HUMIDITY);
+	net_buf_simple_add_le16(msg, (uint16_t) (humidity * 100));
+	net_buf_simple_add_le16(msg, ID_PRESSURE);
+	net_buf_simple_add_le16(msg, (int16_t) (pressure * 100));
+}
+
 /**
  * This callback will be executed right before the periodic publish step, it populates
  * the network buffer.
@@ -33,82 +175,386 @@
 int thp_sensor_update_cb(struct bt_mesh_model *mod) {
 	printk("thp_sensor_update_cb\n");
 
-	float temperature, humidity, pressure;
+	struct thp_snapshot snapshot;
 	struct net_buf_simple *msg = mod->pub->msg;
 
-	if (read_thp(&temperature, &humidity, &pressure)) {
-		printk("Couldn't send thp status message: error reading temperature, humidity and pressure\n");
+	if (thp_snapshot_get(&snapshot)) {
+		printk("Couldn't send thp status message: temperature, humidity and pressure not sampled yet\n");
 		return -1;
 	}
 
-	// Sensor values are sent as 16-bit integers due to errors when sending 32-bit values with zephyr net_buf_simple
-	bt_mesh_model_msg_init(msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
-	net_buf_simple_add_le16(msg, ID_TEMP_CELSIUS);
-	net_buf_simple_add_le16(msg, (int16_t) (temperature * 100)); 
-	net_buf_simple_add_le16(msg, ID_HUMIDITY);
-	net_buf_simple_add_le16(msg, (uint16_t) (humidity * 100));
-	net_buf_simple_add_le16(msg, ID_PRESSURE);
-	net_buf_simple_add_le16(msg, (int16_t) (pressure * 100));
+	thp_sensor_msg_init(msg, snapshot.temperature, snapshot.humidity, snapshot.pressure);
 
-	printf("\nPublishing sensor data: temp %.2f, hum: %.2f, press: %.2f\n", temperature, humidity, pressure);
+	printf("\nPublishing sensor data: temp %.2f, hum: %.2f, press: %.2f\n", snapshot.temperature, snapshot.humidity, snapshot.pressure);
 	
 	return 0;
 }
 
-/* Publication context for temperature (4 bytes), humidity (4 bytes), pressure (4 bytes) */
-BT_MESH_MODEL_PUB_DEFINE(thp_sens_pub, thp_sensor_update_cb, 2+2+2+2+2+2);
+/* Publication context for the opcode, temperature (4 bytes), humidity (4 bytes), pressure (4 bytes) */
+BT_MESH_MODEL_PUB_DEFINE(thp_sens_pub, thp_sensor_update_cb, THP_STATUS_LEN);
+
+/* Sensor Descriptor: tolerances unspecified, instantaneous sampling, no measurement period */
+#define THP_DESCRIPTOR_LEN (2+3+1+1+1)
+#define SENSOR_SAMPLING_INSTANTANEOUS 0x01
+
+/* Update interval of the descriptors, the sample period as 1.1^(n-64) s rounded down */
+static uint8_t thp_update_interval() {
+	uint8_t n = 64;
+	float interval = 1;
+
+	while (n < 0xFF && interval * 1.1f <= THP_SENSOR_SAMPLE_PERIOD) {
+		interval *= 1.1f;
+		n++;
+	}
+	return n;
+}
+
+static void thp_descriptor_add(struct net_buf_simple *msg, uint16_t property_id) {
+	net_buf_simple_add_le16(msg, property_id);
+	// positive and negative tolerance, 12 bits each
+	net_buf_simple_add_u8(msg, 0);
+	net_buf_simple_add_le16(msg, 0);
+	net_buf_simple_add_u8(msg, SENSOR_SAMPLING_INSTANTANEOUS);
+	net_buf_simple_add_u8(msg, 0);
+	net_buf_simple_add_u8(msg, thp_update_interval());
+}
+
+/* Replies with the descriptors of all the THP properties, or of the requested one */
+static void sensor_thp_descriptor_get(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	NET_BUF_SIMPLE_DEFINE(msg, 1 + ARRAY_SIZE(thp_cadence) * THP_DESCRIPTOR_LEN + 4);
+
+	printk("sensor_thp_descriptor_get\n");
+
+	bt_mesh_model_msg_init(&msg, BT_MESH_MODEL_OP_SENSOR_DESCRIPTOR_STATUS);
+	if (buf->len >= 2) {
+		uint16_t property_id = net_buf_simple_pull_le16(buf);
+		if (thp_cadence_get(property_id) != NULL) {
+			thp_descriptor_add(&msg, property_id);
+		} else {
+			// unknown property: the status only carries the property ID
+			net_buf_simple_add_le16(&msg, property_id);
+		}
+	} else {
+		for (int i = 0; i < ARRAY_SIZE(thp_cadence); i++) {
+			thp_descriptor_add(&msg, thp_cadence[i].property_id);
+		}
+	}
+
+	if (bt_mesh_model_send(model, ctx, &msg, NULL, NULL)) {
+		printk("Unable to send sensor descriptor status message\n");
+	}
+}
+
+/**
+ * Appends the marshalled Sensor Data of the THP property at index in thp_cadence. Values are in the published
+ * unit, multiplied by 100, 2 bytes little endian.
+ */
+static void thp_sensor_data_add(struct net_buf_simple *msg, const struct thp_snapshot *snapshot, int index) {
+	int32_t values[3];
+	uint8_t value[2];
+
+	thp_published_values(values, snapshot->temperature, snapshot->humidity, snapshot->pressure);
+	sys_put_le16((uint16_t) values[index], value);
+	sensor_data_add(msg, thp_cadence[index].property_id, value, sizeof(value));
+}
 
 /**
- * Publishes a sensor status message containing the current temperature, humidity and pressure.
+ * Replies with the Sensor Status of a single property from the latest snapshot, like the status of all the
+ * readings: the mesh receive context never waits for the sensors.
+ */
+static void thp_property_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, uint16_t property_id) {
+	NET_BUF_SIMPLE_DEFINE(msg, 1 + SENSOR_DATA_HEADER_MAX_LEN + 2 + 4);
+	struct sensor_cadence *cadence = thp_cadence_get(property_id);
+	struct thp_snapshot snapshot;
+
+	bt_mesh_model_msg_init(&msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
+	if (cadence != NULL) {
+		if (thp_snapshot_get(&snapshot) < 0) {
+			printk("Couldn't send sensor status for property 0x%04x: not sampled yet\n", property_id);
+			return;
+		}
+		thp_sensor_data_add(&msg, &snapshot, cadence - thp_cadence);
+	} else {
+		sensor_data_add_unknown(&msg, property_id);
+	}
+
+	if (bt_mesh_model_send(model, ctx, &msg, NULL, NULL)) {
+		printk("Unable to send sensor status message\n");
+	}
+}
+
+/**
+ * Replies to a Sensor Get with the marshalled Sensor Data of the temperature, humidity and pressure, or with
+ * the status of the requested property only. Unlike publications, replies don't count for the cadence triggers.
  */
 static void sensor_thp_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
-	float temperature, humidity, pressure;
-	struct net_buf_simple *msg = model->pub->msg;
-	int ret;
+	NET_BUF_SIMPLE_DEFINE(msg, 1 + ARRAY_SIZE(thp_cadence) * (SENSOR_DATA_HEADER_MAX_LEN + 2) + 4);
+	struct thp_snapshot snapshot;
 
 	printk("sensor_thp_status\n");
 
-	if (buf->len > 0) {
-		printk("sensor_thp_status with Property ID not supported!\n");
+	if (buf->len >= 2) {
+		thp_property_status(model, ctx, net_buf_simple_pull_le16(buf));
 		return;
 	}
 
-	if (read_thp(&temperature, &humidity, &pressure) < 0) {
-		printk("Couldn't send thp status message: error reading temperature, humidity and pressure\n");
+	if (thp_snapshot_get(&snapshot) < 0) {
+		printk("Couldn't send thp status message: temperature, humidity and pressure not sampled yet\n");
 		return;
 	}
 
-	// Sensor values are sent as 16-bit integers due to errors when sending 32-bit values with zephyr net_buf_simple
-	bt_mesh_model_msg_init(msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
-	net_buf_simple_add_le16(msg, ID_TEMP_CELSIUS);
-	net_buf_simple_add_le16(msg, (int16_t) (temperature * 100)); 
-	net_buf_simple_add_le16(msg, ID_HUMIDITY);
-	net_buf_simple_add_le16(msg, (uint16_t) (humidity * 100));
-	net_buf_simple_add_le16(msg, ID_PRESSURE);
-	net_buf_simple_add_le16(msg, (int16_t) (pressure * 100));
+	bt_mesh_model_msg_init(&msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
+	for (int i = 0; i < ARRAY_SIZE(thp_cadence); i++) {
+		thp_sensor_data_add(&msg, &snapshot, i);
+	}
+
+	printf("\nSending sensor data to 0x%04x: temp %.2f, hum: %.2f, press: %.2f\n", ctx->addr, snapshot.temperature, snapshot.humidity, snapshot.pressure);
+	if (bt_mesh_model_send(model, ctx, &msg, NULL, NULL)) {
+		printk("Unable to send sensor status message\n");
+	}
+}
 
-	printf("\nPublishing sensor data: temp %.2f, hum: %.2f, press: %.2f\n", temperature, humidity, pressure);
-	ret = bt_mesh_model_publish(model);
-	if (ret) {
-		printk("Error publishing sensor status: %d\n", ret);
+/* Largest Raw Value X echoed in a Sensor Column Status: a Format A value */
+#define THP_RAW_VALUE_X_MAX_LEN SENSOR_DATA_FORMAT_A_MAX_LEN
+
+/**
+ * Column and Series Gets: the THP properties are single values, not series, see mesh model spec sections
+ * 4.3.1.2.4 and 4.3.1.2.5. The Column Status echoes the requested Raw Value X without Column Width and Raw
+ * Value Y, raw_x being the rest of the Column Get; the Series Status only carries the property ID.
+ */
+static void thp_no_series_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, uint32_t opcode, uint16_t property_id,
+		struct net_buf_simple *raw_x) {
+	NET_BUF_SIMPLE_DEFINE(msg, 1 + 2 + THP_RAW_VALUE_X_MAX_LEN + 4);
+
+	if (raw_x != NULL && raw_x->len > THP_RAW_VALUE_X_MAX_LEN) {
+		printk("Ignoring sensor column get: Raw Value X of %d bytes\n", raw_x->len);
 		return;
 	}
-	printk("Sensor status published\n");
+
+	bt_mesh_model_msg_init(&msg, opcode);
+	net_buf_simple_add_le16(&msg, property_id);
+	if (raw_x != NULL) {
+		net_buf_simple_add_mem(&msg, raw_x->data, raw_x->len);
+	}
+	if (bt_mesh_model_send(model, ctx, &msg, NULL, NULL)) {
+		printk("Unable to send sensor column or series status message\n");
+	}
+}
+
+static void sensor_thp_column_get(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	printk("sensor_thp_column_get\n");
+	uint16_t property_id = net_buf_simple_pull_le16(buf);
+
+	thp_no_series_status(model, ctx, BT_MESH_MODEL_OP_SENSOR_COLUMN_STATUS, property_id, buf);
+}
+
+static void sensor_thp_series_get(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	printk("sensor_thp_series_get\n");
+	thp_no_series_status(model, ctx, BT_MESH_MODEL_OP_SENSOR_SERIES_STATUS, net_buf_simple_pull_le16(buf), NULL);
 }
 
 /* Opcodes supported by this model */
 static const struct bt_mesh_model_op thp_sens_srv_op[] = {
+	{ BT_MESH_MODEL_OP_SENSOR_DESCRIPTOR_GET, 0, sensor_thp_descriptor_get },
 	{ BT_MESH_MODEL_OP_SENSOR_GET, 0, sensor_thp_status },
+	/* Property ID and a Raw Value X of at least one byte */
+	{ BT_MESH_MODEL_OP_SENSOR_COLUMN_GET, 2+1, sensor_thp_column_get },
+	{ BT_MESH_MODEL_OP_SENSOR_SERIES_GET, 2, sensor_thp_series_get },
 	BT_MESH_MODEL_OP_END,
 };
 
 #define THP_SENSOR_MODEL BT_MESH_MODEL(BT_MESH_MODEL_ID_SENSOR_SRV, thp_sens_srv_op, &thp_sens_pub, NULL)
 
+/* Replies with the Sensor Cadence Status of property_id, only the property ID if it's not a THP property */
+static void thp_cadence_status(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, uint16_t property_id) {
+	struct sensor_cadence *cadence = thp_cadence_get(property_id);
+	NET_BUF_SIMPLE_DEFINE(msg, 1 + 2 + SENSOR_CADENCE_STATE_LEN + 4);
+
+	bt_mesh_model_msg_init(&msg, BT_MESH_MODEL_OP_SENSOR_CADENCE_STATUS);
+	if (cadence != NULL) {
+		sensor_cadence_add(&msg, cadence);
+	} else {
+		net_buf_simple_add_le16(&msg, property_id);
+	}
+
+	if (bt_mesh_model_send(model, ctx, &msg, NULL, NULL)) {
+		printk("Unable to send sensor cadence status message\n");
+	}
+}
+
+static void sensor_thp_cadence_get(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	printk("sensor_thp_cadence_get\n");
+	thp_cadence_status(model, ctx, net_buf_simple_pull_le16(buf));
+}
+
+static void set_thp_cadence(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf, bool ack) {
+	uint16_t property_id = net_buf_simple_pull_le16(buf);
+	struct sensor_cadence *cadence = thp_cadence_get(property_id);
+
+	if (cadence == NULL) {
+		printk("Ignoring sensor cadence set: unknown property ID 0x%04x\n", property_id);
+	} else if (sensor_cadence_pull(cadence, buf)) {
+		// prohibited values: the message is ignored, see mesh model spec section 4.3.1.2
+		printk("Ignoring sensor cadence set: malformed message\n");
+		return;
+	}
+	printk("set_thp_cadence: property 0x%04x\n", property_id);
+
+	if (ack) {
+		thp_cadence_status(model, ctx, property_id);
+	}
+}
+
+static void sensor_thp_cadence_set(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	set_thp_cadence(model, ctx, buf, true);
+}
+
+static void sensor_thp_cadence_set_unack(struct bt_mesh_model *model, struct bt_mesh_msg_ctx *ctx, struct net_buf_simple *buf) {
+	set_thp_cadence(model, ctx, buf, false);
+}
+
+/* Opcodes supported by the setup model */
+static const struct bt_mesh_model_op thp_sens_setup_srv_op[] = {
+	{ BT_MESH_MODEL_OP_SENSOR_CADENCE_GET, 2, sensor_thp_cadence_get },
+	{ BT_MESH_MODEL_OP_SENSOR_CADENCE_SET, 2, sensor_thp_cadence_set },
+	{ BT_MESH_MODEL_OP_SENSOR_CADENCE_SET_UNACK, 2, sensor_thp_cadence_set_unack },
+	BT_MESH_MODEL_OP_END,
+};
+
+#define THP_SENSOR_SETUP_MODEL BT_MESH_MODEL(BT_MESH_MODEL_ID_SENSOR_SETUP_SRV, thp_sens_setup_srv_op, NULL, NULL)
+
+/**
+ * Current publish period (ms) of the sensor model, fast cadence included, 0 if periodic publishing is off.
+ * Computed from the publication state like the mesh stack does, whose own helper isn't a public API.
+ */
+static int32_t thp_pub_period() {
+	int32_t steps = thp_sens_pub.period & BIT_MASK(6);
+	int32_t period;
+
+	// Publish Period: 6 bits of steps and 2 bits of step resolution - mesh profile specification 4.2.2.2
+	switch (thp_sens_pub.period >> 6) {
+	case 0x00:
+		period = steps * 100;
+		break;
+	case 0x01:
+		period = steps * MSEC_PER_SEC;
+		break;
+	case 0x02:
+		period = steps * 10 * MSEC_PER_SEC;
+		break;
+	default:
+		period = steps * 10 * 60 * MSEC_PER_SEC;
+		break;
+	}
+
+	if (thp_sens_pub.fast_period) {
+		return period >> thp_sens_pub.period_div;
+	}
+	return period;
+}
+
+/**
+ * Applies the cadence to the latest snapshot: publishes right away if a reading moved past its triggers, and
+ * divides the publish period while a reading is in its fast cadence range.
+ */
+void thp_cadence_handler(struct k_work *item) {
+	struct thp_snapshot snapshot;
+	int32_t values[3];
+	struct bt_mesh_model *model = thp_sens_pub.mod;
+	bool triggered = false;
+	uint8_t divisor = 0;
+
+	if (model == NULL || thp_sens_pub.addr == BT_MESH_ADDR_UNASSIGNED) {
+		return;
+	}
+	if (thp_snapshot_get(&snapshot)) {
+		return;
+	}
+
+	thp_published_values(values, snapshot.temperature, snapshot.humidity, snapshot.pressure);
+	for (int i = 0; i < ARRAY_SIZE(thp_cadence); i++) {
+		if (sensor_cadence_fast(&thp_cadence[i], values[i]) && thp_cadence[i].fast_period_divisor > divisor) {
+			divisor = thp_cadence[i].fast_period_divisor;
+		}
+		triggered |= sensor_cadence_triggered(&thp_cadence[i], values[i]);
+	}
+
+	// the stack applies the divisor from the next period on
+	thp_sens_pub.fast_period = divisor > 0;
+	thp_sens_pub.period_div = divisor;
+
+	if (!triggered) {
+		return;
+	}
+
+	// sampled ahead of the periodic publication, which is about to carry these values anyway
+	int32_t period = thp_pub_period();
+	if (period > 0 && (int32_t) (thp_sens_pub.period_start + period - k_uptime_get_32())
+			<= THP_SENSOR_CONVERSION_TIME + thp_sample_duration) {
+		return;
+	}
+
+	net_buf_simple_reset(thp_sens_pub.msg);
+	thp_sensor_msg_init(thp_sens_pub.msg, snapshot.temperature, snapshot.humidity, snapshot.pressure);
+
+	printf("\nPublishing triggered sensor data: temp %.2f, hum: %.2f, press: %.2f\n", snapshot.temperature, snapshot.humidity, snapshot.pressure);
+	if (bt_mesh_model_publish(model)) {
+		printk("Error publishing triggered sensor status\n");
+	}
+}
+
+/**
+ * Schedules the next sample after THP_SENSOR_SAMPLE_PERIOD seconds, or earlier so that the values are ready for
+ * the next periodic publication: the publication starts at period_start + period, fast cadence included.
+ */
+static void thp_sample_schedule() {
+	int32_t delay = THP_SENSOR_SAMPLE_PERIOD * MSEC_PER_SEC;
+	struct bt_mesh_model *model = thp_sens_pub.mod;
+
+	if (model != NULL && thp_sens_pub.addr != BT_MESH_ADDR_UNASSIGNED) {
+		int32_t period = thp_pub_period();
+		int32_t lead = THP_SENSOR_CONVERSION_TIME + thp_sample_duration;
+
+		if (period > lead) {
+			// too late for the next publication: sample for the one after
+			int32_t until = (int32_t) (thp_sens_pub.period_start + period - k_uptime_get_32()) - lead;
+			while (until <= 0) {
+				until += period;
+			}
+			delay = MIN(delay, until);
+		}
+	}
+
+	k_delayed_work_submit_to_queue(&thp_sample_queue, &thp_sample_work, K_MSEC(delay));
+}
+
+/* Samples the sensors into the snapshot that isn't ready, on the sampling work queue */
+void thp_sample_handler(struct k_work *item) {
+	float temperature, humidity, pressure;
+	int64_t started = k_uptime_get();
+
+	if (read_thp(&temperature, &humidity, &pressure) == 0) {
+		int next = !atomic_get(&thp_snapshot_ready);
+
+		thp_snapshots[next].temperature = temperature;
+		thp_snapshots[next].humidity = humidity;
+		thp_snapshots[next].pressure = pressure;
+		thp_snapshots[next].time = k_uptime_get();
+		thp_snapshots[next].valid = true;
+		atomic_set(&thp_snapshot_ready, next);
+
+		k_work_submit(&thp_cadence_work);
+	}
+
+	thp_sample_duration = (int32_t) (k_uptime_get() - started);
+	thp_sample_schedule();
+}
+
 /**
  * Can be used to force publication.
  */
 static void thp_sensor_publish_data() {
-	float temperature, humidity, pressure;
+	struct thp_snapshot snapshot;
 	int err;
 	struct bt_mesh_model model = THP_SENSOR_MODEL;
 
@@ -121,21 +567,14 @@ static void thp_sensor_publish_data() {
 		return;
 	}
 
-	if (read_thp(&temperature, &humidity, &pressure)) {
+	if (thp_snapshot_get(&snapshot)) {
 		return;
 	}
 	
 	net_buf_simple_reset(msg);
-	// Sensor values are sent as 16-bit integers due to errors when sending 32-bit values with zephyr net_buf_simple
-	bt_mesh_model_msg_init(msg, BT_MESH_MODEL_OP_SENSOR_STATUS);
-	net_buf_simple_add_le16(msg, ID_TEMP_CELSIUS);
-	net_buf_simple_add_le16(msg, (int16_t) (temperature * 100)); 
-	net_buf_simple_add_le16(msg, ID_HUMIDITY);
-	net_buf_simple_add_le16(msg, (uint16_t) (humidity * 100));
-	net_buf_simple_add_le16(msg, ID_PRESSURE);
-	net_buf_simple_add_le16(msg, (int16_t) (pressure * 100));
+	thp_sensor_msg_init(msg, snapshot.temperature, snapshot.humidity, snapshot.pressure);
 
-	printf("\nPublishing sensor data: temp %.2f, hum: %.2f, press: %.2f\n", temperature, humidity, pressure);
+	printf("\nPublishing sensor data: temp %.2f, hum: %.2f, press: %.2f\n", snapshot.temperature, snapshot.humidity, snapshot.pressure);
 	err = bt_mesh_model_publish(&model);
 	if (err) {
 		printk("bt_mesh_publish error: %d\n", err);
@@ -145,11 +584,20 @@ static void thp_sensor_publish_data() {
 }
 
 /** 
- * Initializes the model and its sensors.
+ * Initializes the model and its sensors, and starts sampling them.
  * @return 0 on success.
  */
 int thp_sensor_setup() {
-	return thp_reader_setup();
+	int err = thp_reader_setup();
+	if (err) {
+		return err;
+	}
+
+	k_work_q_start(&thp_sample_queue, thp_sample_stack, K_THREAD_STACK_SIZEOF(thp_sample_stack), THP_SAMPLE_PRIORITY);
+	k_delayed_work_init(&thp_sample_work, thp_sample_handler);
+	k_work_init(&thp_cadence_work, thp_cadence_handler);
+	k_delayed_work_submit_to_queue(&thp_sample_queue, &thp_sample_work, K_NO_WAIT);
+	return 0;
 }
 
 /**
@@ -166,11 +614,18 @@ int thp_sensor_autoconf(uint16_t root_addr, uint16_t elem_addr, uint16_t pub_per
 		return err;
 	}
 
+	err = bt_mesh_cfg_mod_app_bind(0, root_addr, elem_addr, 0, BT_MESH_MODEL_ID_SENSOR_SETUP_SRV, NULL);
+	if (err) {
+		printk("Error binding default app key to THP sensor setup model\n");
+		return err;
+	}
+
 	struct bt_mesh_cfg_mod_pub pub_thp = {
 		.addr = 0xFFFF,
 		.app_idx = 0,
 		.ttl = 7,
-		.period = BT_MESH_PUB_PERIOD_SEC(pub_period),
+		// 1 s resolution up to 63 s, 10 s above
+		.period = pub_period < 64 ? BT_MESH_PUB_PERIOD_SEC(pub_period) : BT_MESH_PUB_PERIOD_10SEC(pub_period / 10),
 		.transmit = BT_MESH_TRANSMIT(0, 20),
 	};
 
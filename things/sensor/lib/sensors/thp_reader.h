@@ -1,11 +1,14 @@
 /**
  * Wrapper for reading temperature, humidity and pressure with one call.
+ * Readings are cached for THP_READER_MAX_AGE ms, so that Sensor Gets and publications close in time share the
+ * same sample instead of each reading the sensors over I2C. The functions can be called from any thread.
  * */
 
 #ifndef THP_READER_H
 #define THP_READER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "ccs811.h"
 #include "hts221.h"
@@ -14,30 +17,96 @@
 const struct device *hts221 = NULL;
 const struct device *lps22hb = NULL;
 
+/* Readings younger than this (ms) are served from the cache instead of reading the sensors again */
+#ifndef THP_READER_MAX_AGE
+#define THP_READER_MAX_AGE 2000
+#endif
+
+/* Last sample of a sensor, values in sensor units */
+struct thp_reading {
+    float values[2];
+    int64_t time;
+    bool valid;
+};
+
+struct thp_reading hts221_reading;
+struct thp_reading lps22hb_reading;
+
+/* Held while a sensor is sampled: callers asking for the same sensor meanwhile get that sample */
+K_MUTEX_DEFINE(thp_reader_mutex);
+
+/* Sensor reads and cache hits, for debugging */
+uint32_t thp_reader_samples = 0;
+uint32_t thp_reader_cache_hits = 0;
+
+static bool thp_reading_fresh(const struct thp_reading *reading) {
+    return reading->valid && k_uptime_get() - reading->time <= THP_READER_MAX_AGE;
+}
+
+static void thp_reading_set(struct thp_reading *reading, struct sensor_value *first, struct sensor_value *second) {
+    reading->values[0] = (float) sensor_value_to_double(first);
+    reading->values[1] = second != NULL ? (float) sensor_value_to_double(second) : 0;
+    reading->time = k_uptime_get();
+    reading->valid = true;
+    thp_reader_samples++;
+}
+
+/* Temperature and humidity from the HTS221, sampled at most every THP_READER_MAX_AGE ms */
+int read_temperature_humidity(float *temperature, float *humidity) {
+    struct sensor_value temp_reading, hum_reading;
+    int err = 0;
+
+    k_mutex_lock(&thp_reader_mutex, K_FOREVER);
+    if (thp_reading_fresh(&hts221_reading)) {
+        thp_reader_cache_hits++;
+    } else if (hts221 == NULL || hts221_handler(hts221, &temp_reading, &hum_reading) < 0) {
+        printk("Failed reading temperature and humidity\n");
+        err = -1;
+    } else {
+        thp_reading_set(&hts221_reading, &temp_reading, &hum_reading);
+    }
+
+    if (!err) {
+        *temperature = hts221_reading.values[0];
+        *humidity = hts221_reading.values[1];
+    }
+    k_mutex_unlock(&thp_reader_mutex);
+    return err;
+}
+
+/* Pressure from the LPS22HB, sampled at most every THP_READER_MAX_AGE ms */
+int read_pressure(float *pressure) {
+    struct sensor_value press_reading;
+    int err = 0;
+
+    k_mutex_lock(&thp_reader_mutex, K_FOREVER);
+    if (thp_reading_fresh(&lps22hb_reading)) {
+        thp_reader_cache_hits++;
+    } else if (lps22hb == NULL || lps22hb_handler(lps22hb, &press_reading) < 0) {
+        printk("Failed reading pressure\n");
+        err = -1;
+    } else {
+        thp_reading_set(&lps22hb_reading, &press_reading, NULL);
+    }
+
+    if (!err) {
+        *pressure = lps22hb_reading.values[0];
+    }
+    k_mutex_unlock(&thp_reader_mutex);
+    return err;
+}
+
 int read_thp(float *temperature, float *humidity, float *pressure) {
-    struct sensor_value temp_reading, hum_reading, press_reading;
-    
     if (hts221 == NULL || lps22hb == NULL) {
         printk("Can't read temperature, humidity and pressure: null ref to devices");
         return -1;
     }
 
-    if (hts221_handler(hts221, &temp_reading, &hum_reading) < 0 || lps22hb_handler(lps22hb, &press_reading) < 0) {
+    if (read_temperature_humidity(temperature, humidity) < 0 || read_pressure(pressure) < 0) {
         printk("Failed reading temperature, humidity and pressure\n");
         return -1;
     }
 
-    if (lps22hb_handler(lps22hb, &press_reading) < 0) {
-        printk("Failed reading pressure\n");
-        return -1;
-    }
-
-    // Values are converted to 16-bit integers due to errors sending 
-    // 32-bit values using net_buf_simple
-    *temperature = (float) sensor_value_to_double(&temp_reading);
-    *humidity = (float) sensor_value_to_double(&hum_reading);
-    *pressure = (float) sensor_value_to_double(&press_reading);  
-
     return 0;
 }
 
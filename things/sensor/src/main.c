@@ -3,6 +3,9 @@
 #include <settings/settings.h>
 #include <bluetooth/mesh.h>
 
+// 1 to publish THP readings with the compact vendor status (single PDU), see thp_sensor.h
+#define THP_SENSOR_COMPACT_STATUS 0
+
 #include <../lib/models/thp_sensor.h>
 #include <../lib/models/gas_sensor.h>
 #include <../lib/models/generic_onoff.h>
@@ -10,7 +13,8 @@
 #include <../lib/devices/button.h>
 
 #define GAS_TRIGGER_THRESHOLD 800
-#define THP_MODEL_PUB_PERIOD 60
+// the cadence triggers publish changes in between, see thp_sensor.h
+#define THP_MODEL_PUB_PERIOD 300
 
 struct k_delayed_work thp_autoconf_work;
 struct k_delayed_work gas_autoconf_work;
@@ -112,6 +116,7 @@ static struct bt_mesh_model root_models[] = {
 		BT_MESH_MODEL_HEALTH_SRV(&health_srv, &health_pub),
         GENERIC_ONOFF_MODEL,
 		THP_SENSOR_MODEL,
+		THP_SENSOR_SETUP_MODEL,
 };
 
 static struct bt_mesh_model sens_gas_model[] = {